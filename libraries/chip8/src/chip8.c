@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,8 +23,143 @@ static uint8_t sprites[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80, // F
 };
 
+static uint8_t large_sprites[] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0, // F
+};
+
+/**
+ * Opcode id of each opcode, for each variant: decoding is a single load.
+ * Filled once by the first chip8_init.
+ */
+static uint8_t decode_tables[VARIANT_XO_CHIP + 1][65536];
+static pthread_once_t decode_tables_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Identify an opcode: the original instruction set first, then the ones each extension adds or replaces.
+ */
+static Chip8OpcodeId classify(Chip8Variant variant, uint16_t opcode) {
+    uint16_t n1 = opcode & 0xF000;
+    uint16_t n4 = opcode & 0x000F;
+    uint8_t kk = opcode & 0xFF;
+    Chip8OpcodeId id = OPCODE_INVALID;
+
+    // Basic opcodes
+    if (n1 == 0x0000) {
+        if (opcode == 0x00e0) id = OPCODE_CLS;
+        else if (opcode == 0x00ee) id = OPCODE_RET;
+    }
+    else if (n1 == 0x1000) id = OPCODE_JMP_NNN;
+    else if (n1 == 0x2000) id = OPCODE_CALL_NNN;
+    else if (n1 == 0x3000) id = OPCODE_SE_VX_KK;
+    else if (n1 == 0x4000) id = OPCODE_SNE_VX_KK;
+    else if (n1 == 0x5000) {
+        if (n4 == 0) id = OPCODE_SE_VX_VY;
+    }
+    else if (n1 == 0x6000) id = OPCODE_LD_VX_KK;
+    else if (n1 == 0x7000) id = OPCODE_ADD_VX_KK;
+    else if (n1 == 0x8000) {
+        if (n4 == 0x0000) id = OPCODE_LD_VX_VY;
+        else if (n4 == 0x0001) id = OPCODE_OR_VX_VY;
+        else if (n4 == 0x0002) id = OPCODE_AND_VX_VY;
+        else if (n4 == 0x0003) id = OPCODE_XOR_VX_VY;
+        else if (n4 == 0x0004) id = OPCODE_ADD_VX_VY;
+        else if (n4 == 0x0005) id = OPCODE_SUB_VX_VY;
+        else if (n4 == 0x0006) id = OPCODE_SHR_VX_VY;
+        else if (n4 == 0x0007) id = OPCODE_SUBN_VX_VY;
+        else if (n4 == 0x000e) id = OPCODE_SHL_VX_VY;
+    }
+    else if (n1 == 0x9000) {
+        if (n4 == 0x0000) id = OPCODE_SNE_VX_VY;
+    }
+    else if (n1 == 0xA000) id = OPCODE_LD_I_NNN;
+    else if (n1 == 0xB000) id = OPCODE_JP_V0_NNN;
+    else if (n1 == 0xC000) id = OPCODE_RND_VX_KK;
+    else if (n1 == 0xD000) id = OPCODE_DRW_VX_VY_N;
+    else if (n1 == 0xE000) {
+        if (kk == 0x009e) id = OPCODE_SKP_VX;
+        else if (kk == 0x00a1) id = OPCODE_SKNP_VX;
+    }
+    else if (n1 == 0xF000) {
+        if (kk == 0x07) id = OPCODE_LD_VX_DT;
+        else if (kk == 0x0a) id = OPCODE_LD_VX_K;
+        else if (kk == 0x15) id = OPCODE_LD_DT_VX;
+        else if (kk == 0x18) id = OPCODE_LD_ST_VX;
+        else if (kk == 0x1e) id = OPCODE_ADD_I_VX;
+        else if (kk == 0x29) id = OPCODE_LD_F_VX;
+        else if (kk == 0x33) id = OPCODE_LD_B_VX;
+        else if (kk == 0x55) id = OPCODE_LD_I_VX;
+        else if (kk == 0x65) id = OPCODE_LD_VX_I;
+    }
+
+    // Two pages opcodes
+    if (variant == VARIANT_TWO_PAGES) {
+        if (opcode == 0x0230) id = OPCODE_CLS;
+    }
+
+    // SuperChip opcodes
+    if (variant == VARIANT_SUPER_CHIP || variant == VARIANT_XO_CHIP) {
+        if (n1 == 0x0000) {
+            if ((opcode & 0xfff0) == 0x00c0) id = OPCODE_SCRL_DOWN_N;
+            else if (opcode == 0x00fb) id = OPCODE_SCRL_RIGHT;
+            else if (opcode == 0x00fc) id = OPCODE_SCRL_LEFT;
+            else if (opcode == 0x00fd) id = OPCODE_EXIT;
+            else if (opcode == 0x00fe) id = OPCODE_HIDEF_OFF;
+            else if (opcode == 0x00ff) id = OPCODE_HIDEF_ON;
+        }
+        else if (n1 == 0xD000 && n4 == 0x0000) {
+            id = OPCODE_DRW_VX_VY_0;
+        }
+        else if (n1 == 0xF000) {
+            if (kk == 0x30) id = OPCODE_LD_I_DIGIT;
+            else if (kk == 0x75) id = OPCODE_LD_RPL_VX;
+            else if (kk == 0x85) id = OPCODE_LD_VX_RPL;
+        }
+    }
+
+    // XO-Chip opcodes
+    if (variant == VARIANT_XO_CHIP) {
+        if (n1 == 0x0000) {
+            if ((opcode & 0xfff0) == 0x00d0) id = OPCODE_SCRL_UP_N;
+        }
+        else if (n1 == 0x5000) {
+            if (n4 == 2) id = OPCODE_LD_I_VX_VY;
+            else if (n4 == 3) id = OPCODE_LD_VX_VY_I;
+        }
+        else if (n1 == 0xf000) {
+            if (opcode == 0xf000) id = OPCODE_LD_I_NNNN;
+            else if (kk == 0x01) id = OPCODE_DRW_PLN_N;
+            else if (kk == 0x02) id = OPCODE_LD_AUDIO_I;
+        }
+    }
+
+    return id;
+}
+
+static void build_decode_tables(void) {
+    for (uint32_t variant = 0; variant <= VARIANT_XO_CHIP; ++variant)
+        for (uint32_t opcode = 0; opcode < 65536; ++opcode)
+            decode_tables[variant][opcode] = (uint8_t) classify((Chip8Variant) variant, (uint16_t) opcode);
+}
+
 Chip8Error chip8_init(Chip8 *state, Chip8Variant variant, uint32_t clock_speed)
 {
+    pthread_once(&decode_tables_once, build_decode_tables);
+
     memset(state, 0, sizeof *state);
     state->variant = variant;
     state->clock_speed = clock_speed;
@@ -45,13 +181,34 @@ Chip8Error chip8_init(Chip8 *state, Chip8Variant variant, uint32_t clock_speed)
         state->display_width = 128;
         state->display_height = 64;
     }
-    state->display = malloc(state->display_width * state->display_height);
+    state->display = calloc(state->display_width * state->display_height, 1);
     state->display_mask = 1;
-    memcpy(state->memory, sprites, 5 * 16); // Fonts
+    memcpy(state->memory + CHIP8_FONT, sprites, sizeof sprites); // Fonts
+    memcpy(state->memory + CHIP8_LARGE_FONT, large_sprites, sizeof large_sprites);
 
     return CHIP8_OK;
 }
 
+void chip8_release(Chip8 *state)
+{
+    free(state->memory);
+    free(state->display);
+    free(state->decoded);
+    state->memory = state->display = NULL;
+    state->decoded = NULL;
+}
+
+/**
+ * Decode again the instructions kept for the interpreter between start and end.
+ */
+static void decode_range(Chip8 *state, uint32_t start, uint32_t end)
+{
+    uint32_t mem_size = state->variant == VARIANT_XO_CHIP ? 65536 : 4096;
+
+    for (uint32_t address = start; address < end && address + 1 < mem_size; ++address)
+        chip8_decode(state, &state->decoded[address], address);
+}
+
 Chip8Error chip8_load_rom(Chip8 *state, const char *rom)
 {
     FILE *f = fopen(rom, "rb");
@@ -69,111 +226,184 @@ Chip8Error chip8_load_rom(Chip8 *state, const char *rom)
     fread(state->memory + 0x200, fsize, 1, f);
     fclose(f);
 
+    if (state->decoded)
+        decode_range(state, 0, mem_size);
+
     return CHIP8_OK;
 }
 
 Chip8Error chip8_decode(Chip8 *state, Chip8Opcode* decoded, uint16_t address) {
     uint16_t opcode = decoded->opcode = state->memory[address + 1] | (state->memory[address] << 8); // big endian
-    uint16_t n1 = opcode & 0xF000;
-    uint16_t n4 = opcode & 0x000F;
-    uint8_t kk = decoded->kk = opcode & 0xFF;
 
-    decoded->id = OPCODE_INVALID;
+    decoded->id = (Chip8OpcodeId) decode_tables[state->variant][opcode];
     decoded->x = (opcode >> 8) & 0x0F;
     decoded->y = (opcode >> 4) & 0x0F;
     decoded->n = opcode & 0x0F;
+    decoded->kk = opcode & 0xFF;
     decoded->nnn = opcode & 0x0FFF;
 
-    // Basic opcodes
-    if (n1 == 0x0000) {
-        if (opcode == 0x00e0) decoded->id = OPCODE_CLS;
-        else if (opcode == 0x00ee) decoded->id = OPCODE_RET;
-    }
-    else if (n1 == 0x1000) decoded->id = OPCODE_JMP_NNN;
-    else if (n1 == 0x2000) decoded->id = OPCODE_CALL_NNN;
-    else if (n1 == 0x3000) decoded->id = OPCODE_SE_VX_KK;
-    else if (n1 == 0x4000) decoded->id = OPCODE_SNE_VX_KK;
-    else if (n1 == 0x5000) {
-        if (n4 == 0) decoded->id = OPCODE_SE_VX_VY;
-    }
-    else if (n1 == 0x6000) decoded->id = OPCODE_LD_VX_KK;
-    else if (n1 == 0x7000) decoded->id = OPCODE_ADD_VX_KK;
-    else if (n1 == 0x8000) {
-        if (n4 == 0x0000) decoded->id = OPCODE_LD_VX_VY;
-        else if (n4 == 0x0001) decoded->id = OPCODE_OR_VX_VY;
-        else if (n4 == 0x0002) decoded->id = OPCODE_AND_VX_VY;
-        else if (n4 == 0x0003) decoded->id = OPCODE_XOR_VX_VY;
-        else if (n4 == 0x0004) decoded->id = OPCODE_ADD_VX_VY;
-        else if (n4 == 0x0005) decoded->id = OPCODE_SUB_VX_VY;
-        else if (n4 == 0x0006) decoded->id = OPCODE_SHR_VX_VY;
-        else if (n4 == 0x0007) decoded->id = OPCODE_SUBN_VX_VY;
-        else if (n4 == 0x000e) decoded->id = OPCODE_SHL_VX_VY;
-    }
-    else if (n1 == 0x9000) {
-        if (n4 == 0x0000) decoded->id = OPCODE_SNE_VX_VY;
-    }
-    else if (n1 == 0xA000) decoded->id = OPCODE_LD_I_NNN;
-    else if (n1 == 0xB000) decoded->id = OPCODE_JP_V0_NNN;
-    else if (n1 == 0xC000) decoded->id = OPCODE_RND_VX_KK;
-    else if (n1 == 0xD000) decoded->id = OPCODE_DRW_VX_VY_N;
-    else if (n1 == 0xE000) {
-        if (kk == 0x009e) decoded->id = OPCODE_SKP_VX;
-        else if (kk == 0x00a1) decoded->id = OPCODE_SKNP_VX;
-    }
-    else if (n1 == 0xF000) {
-        if (kk == 0x07) decoded->id = OPCODE_LD_VX_DT;
-        else if (kk == 0x0a) decoded->id = OPCODE_LD_VX_K;
-        else if (kk == 0x15) decoded->id = OPCODE_LD_DT_VX;
-        else if (kk == 0x18) decoded->id = OPCODE_LD_ST_VX;
-        else if (kk == 0x1e) decoded->id = OPCODE_ADD_I_VX;
-        else if (kk == 0x29) decoded->id = OPCODE_LD_F_VX;
-        else if (kk == 0x33) decoded->id = OPCODE_LD_B_VX;
-        else if (kk == 0x55) decoded->id = OPCODE_LD_I_VX;
-        else if (kk == 0x65) decoded->id = OPCODE_LD_VX_I;
-    }
+    return decoded->id == OPCODE_INVALID ? CHIP8_OPCODE_INVALID : CHIP8_OK;
+}
 
-    // Two pages opcodes
-    if (state->variant == VARIANT_TWO_PAGES) {
-        if (opcode == 0x0230) decoded->id = OPCODE_CLS;
-    }
+/**
+ * XOR a sprite onto the selected display planes.
+ * XO-Chip reads one sprite per plane, one after the other.
+ */
+static void draw_sprite(Chip8 *state, uint8_t x, uint8_t y, uint8_t rows, uint8_t columns)
+{
+    // Display sizes are powers of two: wrap around with masks.
+    uint32_t width_mask = state->display_width - 1;
+    uint32_t height_mask = state->display_height - 1;
+    uint8_t *sprite = state->memory + state->I;
+    uint8_t collision = 0;
 
-    // SuperChip opcodes
-    if (state->variant == VARIANT_SUPER_CHIP || state->variant == VARIANT_XO_CHIP) {
-        if (n1 == 0x0000) {
-            if ((opcode & 0xfff0) == 0x00c0) decoded->id = OPCODE_SCRL_DOWN_N;
-            else if (opcode == 0x00fb) decoded->id = OPCODE_SCRL_RIGHT;
-            else if (opcode == 0x00fc) decoded->id = OPCODE_SCRL_LEFT;
-            else if (opcode == 0x00fd) decoded->id = OPCODE_EXIT;
-            else if (opcode == 0x00fe) decoded->id = OPCODE_HIDEF_ON;
-            else if (opcode == 0x00ff) decoded->id = OPCODE_HIDEF_OFF;
-        }
-        else if (n1 == 0xD000 && n4 == 0x0000) {
-            decoded->id = OPCODE_DRW_VX_VY_0;
-        }
-        else if (n1 == 0xF000) {
-            if (kk == 0x30) decoded->id = OPCODE_LD_I_DIGIT;
-            else if (kk == 0x75) decoded->id = OPCODE_LD_RPL_VX;
-            else if (kk == 0x85) decoded->id = OPCODE_LD_VX_RPL;
+    for (uint8_t plane = 1; plane <= 2; plane <<= 1) {
+        if (!(state->display_mask & plane))
+            continue;
+
+        for (uint8_t row = 0; row < rows; ++row) {
+            uint16_t bits = columns == 16 ? sprite[0] << 8 | sprite[1] : sprite[0] << 8;
+            sprite += columns / 8;
+            if (!bits)
+                continue;
+
+            uint8_t *line = state->display + ((y + row) & height_mask) * state->display_width;
+            for (uint8_t column = 0; column < columns; ++column) {
+                if ((bits >> (15 - column)) & 1) {
+                    uint8_t *position = line + ((x + column) & width_mask);
+
+                    collision |= *position & plane;
+                    *position ^= plane;
+                }
+            }
         }
     }
 
-    // XO-Chip opcodes
-    if (state->variant == VARIANT_XO_CHIP) {
-        if (n1 == 0x0000) {
-            if ((opcode & 0xfff0) == 0x00d0) decoded->id = OPCODE_SCRL_UP_N;
-        }
-        else if (n1 == 0x5000) {
-            if (n4 == 2) decoded->id = OPCODE_LD_I_VX_VY;
-            else if (n4 == 3) decoded->id = OPCODE_LD_VX_VY_I;
+    state->registers[15] = collision != 0;
+    state->display_dirty = true;
+}
+
+void chip8_draw_sprite(Chip8 *state, uint8_t x, uint8_t y, uint8_t n)
+{
+    draw_sprite(state, x, y, n, 8);
+}
+
+void chip8_draw_large_sprite(Chip8 *state, uint8_t x, uint8_t y)
+{
+    draw_sprite(state, x, y, 16, 16);
+}
+
+void chip8_clear_display(Chip8 *state)
+{
+    uint32_t size = state->display_width * state->display_height;
+
+    for (uint32_t i = 0; i < size; ++i)
+        state->display[i] &= ~state->display_mask;
+
+    state->display_dirty = true;
+}
+
+void chip8_scroll_display(Chip8 *state, int32_t dx, int32_t dy)
+{
+    int32_t width = state->display_width;
+    int32_t height = state->display_height;
+    uint8_t mask = state->display_mask;
+
+    // Walk against the scroll direction, so that pixels are read before being overwritten.
+    for (int32_t j = 0; j < height; ++j) {
+        int32_t y = dy > 0 ? height - 1 - j : j;
+
+        for (int32_t i = 0; i < width; ++i) {
+            int32_t x = dx > 0 ? width - 1 - i : i;
+            int32_t from_x = x - dx;
+            int32_t from_y = y - dy;
+
+            uint8_t pixel = 0;
+            if (0 <= from_x && from_x < width && 0 <= from_y && from_y < height)
+                pixel = state->display[from_y * width + from_x] & mask;
+
+            uint8_t *position = state->display + y * width + x;
+            *position = (*position & ~mask) | pixel;
         }
-        else if (n1 == 0xf000) {
-            if (opcode == 0xf000) decoded->id = OPCODE_LD_I_NNNN;
-            else if (kk == 0x01) decoded->id = OPCODE_DRW_PLN_N;
-            else if (kk == 0x02) decoded->id = OPCODE_LD_AUDIO_I;
+    }
+
+    state->display_dirty = true;
+}
+
+int32_t chip8_pressed_key(Chip8 *state)
+{
+    for (int32_t i = 0; i < 16; ++i)
+        if (state->keyboard[i])
+            return i;
+
+    return -1;
+}
+
+uint32_t chip8_idle_loop(Chip8 *state, uint16_t start, uint16_t end)
+{
+    if (start > end || end - start > 2 * CHIP8_IDLE_LOOP_MAX)
+        return 0;
+
+    for (uint16_t address = start; address < end; address += 2) {
+        Chip8Opcode opcode;
+        chip8_decode(state, &opcode, address);
+
+        switch (opcode.id) {
+            case OPCODE_LD_VX_DT:
+            case OPCODE_LD_VX_KK:
+                break;
+
+            // Skips may only leave the loop, by skipping the jump back.
+            case OPCODE_SE_VX_KK:
+            case OPCODE_SNE_VX_KK:
+            case OPCODE_SE_VX_VY:
+            case OPCODE_SNE_VX_VY:
+            case OPCODE_SKP_VX:
+            case OPCODE_SKNP_VX:
+                if (address + 2 != end)
+                    return 0;
+                break;
+
+            default:
+                return 0;
         }
     }
 
-    return decoded->id == OPCODE_INVALID ? CHIP8_OPCODE_INVALID : CHIP8_OK;
+    return (end - start) / 2 + 1;
+}
+
+void chip8_predecode(Chip8 *state)
+{
+    uint32_t mem_size = state->variant == VARIANT_XO_CHIP ? 65536 : 4096;
+
+    // Zeroed entries already hold what opcode 0000 decodes to, the last byte cannot start an instruction.
+    state->decoded = (Chip8Opcode*) calloc(mem_size, sizeof(Chip8Opcode));
+    decode_range(state, 0, mem_size);
+}
+
+void chip8_mark_written(Chip8 *state, uint32_t address, uint32_t length)
+{
+    // The instruction starting just before the first written byte changed too.
+    if (state->decoded)
+        decode_range(state, address ? address - 1 : 0, address + length);
+
+    uint32_t first_page = address >> CHIP8_PAGE_SHIFT;
+    uint32_t last_page = (address + length - 1) >> CHIP8_PAGE_SHIFT;
+
+    for (uint32_t page = first_page; page <= last_page && page < CHIP8_PAGE_COUNT; ++page) {
+        if (state->code_pages[page]) {
+            if (state->written_start == state->written_end) {
+                state->written_start = address;
+                state->written_end = address + length;
+            }
+            else {
+                if (address < state->written_start) state->written_start = address;
+                if (address + length > state->written_end) state->written_end = address + length;
+            }
+
+            return;
+        }
+    }
 }
 
 int chip8_dump(Chip8 *state, FILE *f)
@@ -19,6 +19,24 @@ typedef enum {
 } Chip8Error;
 
 
+/**
+ * Memory is split in pages to track writes over translated code.
+ */
+#define CHIP8_PAGE_SHIFT 8
+#define CHIP8_PAGE_COUNT (65536 >> CHIP8_PAGE_SHIFT)
+
+/**
+ * Longest idle loop recognised, in instructions before the jump back.
+ */
+#define CHIP8_IDLE_LOOP_MAX 8
+
+/**
+ * Fonts location in memory.
+ */
+#define CHIP8_FONT 0x00         // 5 bytes hexadecimal digits
+#define CHIP8_LARGE_FONT 0x50   // 10 bytes hexadecimal digits (S-Chip & XO-Chip)
+
+
 /**
  * List of supported chip8 variants.
  * 
@@ -32,44 +50,6 @@ typedef enum {
 } Chip8Variant;
 
 
-typedef struct
-{
-    Chip8Variant variant;
-
-    uint32_t clock_speed;
-    uint32_t cycles_since_started;
-
-    bool display_dirty;
-
-    ////////////
-    // Machine
-    ////////////
-
-    uint8_t *memory;
-
-    // IO
-    uint8_t *display;
-    uint8_t display_mask;
-    uint32_t display_width;
-    uint32_t display_height;
-    uint8_t keyboard[16];
-
-    // Registers
-    uint8_t registers[16];
-    uint8_t DT;
-    uint8_t ST;
-
-    // Pseudo-registers
-    uint16_t I;
-    uint16_t PC;
-
-    // Stack
-    uint8_t SP;
-    uint16_t stack[16];
-
-} Chip8;
-
-
 typedef enum {
     OPCODE_INVALID,
 
@@ -111,8 +91,8 @@ typedef enum {
 
     // S-Chip
     OPCODE_SCRL_DOWN_N, // 00cn Scroll display N lines down
-    OPCODE_SCRL_LEFT,   // 00fb Scroll display 4 pixels right
-    OPCODE_SCRL_RIGHT,  // 00fc Scroll display 4 pixels left
+    OPCODE_SCRL_LEFT,   // 00fc Scroll display 4 pixels left
+    OPCODE_SCRL_RIGHT,  // 00fb Scroll display 4 pixels right
     OPCODE_EXIT,        // 00fd Exit CHIP interpreter
     OPCODE_HIDEF_OFF,   // 00fe Disable extended screen mode
     OPCODE_HIDEF_ON,    // 00ff Enable extended screen mode for full-screen graphics
@@ -142,6 +122,70 @@ typedef struct {
 } Chip8Opcode;
 
 
+typedef struct
+{
+    Chip8Variant variant;
+
+    uint32_t clock_speed;
+    uint32_t cycles_since_started;
+    uint32_t cycles_limit; // Blocks stop chaining, and idle loops stop being skipped past this point
+
+    bool display_dirty;
+
+    ////////////
+    // Machine
+    ////////////
+
+    uint8_t *memory;
+
+    // IO
+    uint8_t *display;
+    uint8_t display_mask;
+    uint32_t display_width;
+    uint32_t display_height;
+    uint8_t keyboard[16];
+
+    // Registers
+    uint8_t registers[16];
+    uint8_t DT;
+    uint8_t ST;
+
+    // Pseudo-registers
+    uint16_t I;
+    uint16_t PC;
+
+    // Stack
+    uint8_t SP;
+    uint16_t stack[16];
+
+    // S-Chip & XO-Chip
+    uint8_t rpl[16];    // RPL user flags
+    uint8_t audio[16];  // Audio pattern buffer
+
+    ////////////
+    // Self-modifying code
+    ////////////
+
+    uint8_t code_pages[CHIP8_PAGE_COUNT]; // Pages of memory holding translated code
+    uint32_t written_start; // Range of translated code overwritten since the recompiler last checked
+    uint32_t written_end;
+
+    ////////////
+    // Return prediction
+    ////////////
+
+    uint16_t return_calls[16]; // Address of the translated CALL which pushed each entry of the stack
+    uint8_t* return_code[16];  // Translated code continuing after that CALL, NULL when unknown
+
+    ////////////
+    // Interpreter
+    ////////////
+
+    Chip8Opcode* decoded; // Instruction at each address for interpreter_run, NULL until chip8_predecode
+
+} Chip8;
+
+
 /**
  * Initialize the Chip8 struct
  * 
@@ -150,8 +194,78 @@ typedef struct {
  * @returns 
  */
 Chip8Error chip8_init(Chip8 *state, Chip8Variant variant, uint32_t clock_speed);
+
+/**
+ * Free the memory, display and decoded instructions of a Chip8 struct.
+ */
+void chip8_release(Chip8 *state);
 Chip8Error chip8_load_rom(Chip8 *state, const char *rom);
 Chip8Error chip8_decode(Chip8 *state, Chip8Opcode* opcode, uint16_t address);
 
+/**
+ * Draw an n-byte sprite read from memory at I, XORed onto the display at (x, y).
+ * VF is set when any pixel gets erased, sprites wrap around the edges of the display.
+ *
+ * @param state Chip8 state
+ * @param x Horizontal position in pixels.
+ * @param y Vertical position in pixels.
+ * @param n Sprite height.
+ */
+void chip8_draw_sprite(Chip8 *state, uint8_t x, uint8_t y, uint8_t n);
+
+/**
+ * Draw a 16x16 sprite, same as chip8_draw_sprite otherwise.
+ */
+void chip8_draw_large_sprite(Chip8 *state, uint8_t x, uint8_t y);
+
+/**
+ * Clear the display planes selected by display_mask.
+ */
+void chip8_clear_display(Chip8 *state);
+
+/**
+ * Move the display planes selected by display_mask, uncovered pixels are cleared.
+ *
+ * @param state Chip8 state
+ * @param dx Horizontal offset in pixels (positive values scroll right).
+ * @param dy Vertical offset in pixels (positive values scroll down).
+ */
+void chip8_scroll_display(Chip8 *state, int32_t dx, int32_t dy);
+
+/**
+ * @returns Lowest pressed key, -1 if none.
+ */
+int32_t chip8_pressed_key(Chip8 *state);
+
+/**
+ * Whether the loop from start to a jump back at end only waits for the delay timer or a key.
+ *
+ * Idle loops only read DT, keys and constants, so that all iterations behave the same
+ * as long as DT and keys do not change.
+ *
+ * @param state Chip8 state
+ * @param start Target of the jump.
+ * @param end Address of the jump.
+ * @returns Number of instructions of an iteration, 0 if the loop is not idle.
+ */
+uint32_t chip8_idle_loop(Chip8 *state, uint16_t start, uint16_t end);
+
+/**
+ * Decode the instruction at each address of memory, which chip8_mark_written then keeps up to date.
+ *
+ * @param state Chip8 state
+ */
+void chip8_predecode(Chip8 *state);
+
+/**
+ * Must be called after writing to memory, so that translated code can be invalidated,
+ * and instructions decoded for the interpreter decoded again. Callers writing to memory must call it too.
+ *
+ * @param state Chip8 state
+ * @param address First written address.
+ * @param length Number of written bytes.
+ */
+void chip8_mark_written(Chip8 *state, uint32_t address, uint32_t length);
+
 int chip8_dump(Chip8 *state, FILE *f);
 int chip8_restore(Chip8 *state, FILE *f);
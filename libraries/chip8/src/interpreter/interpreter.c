@@ -5,20 +5,35 @@
 #include "../disasm.h"
 
 
-static Chip8Error exec_not_supported(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_invalid(Chip8 *state, Chip8Opcode* opcode)
 {
     (void) state;
     (void) opcode;
 
-    return CHIP8_OPCODE_NOT_SUPPORTED;
+    return CHIP8_OPCODE_INVALID;
 }
 
-static Chip8Error exec_invalid(Chip8 *state, Chip8Opcode* opcode)
+/**
+ * Run loops are specialized for each variant: execute must be inlined into each of them.
+ */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/**
+ * Length of the instruction which follows PC, for skips.
+ * XO-Chip's F000 NNNN is the only instruction which is 4 bytes long.
+ */
+static uint16_t next_length(Chip8 *state, Chip8Variant variant)
 {
-    (void) state;
-    (void) opcode;
+    uint16_t next = state->PC + 2;
 
-    return CHIP8_OPCODE_INVALID;
+    if (variant == VARIANT_XO_CHIP && state->memory[next] == 0xF0 && state->memory[next + 1] == 0x00)
+        return 4;
+
+    return 2;
 }
 
 /**
@@ -29,7 +44,7 @@ static Chip8Error exec_cls(Chip8 *state, Chip8Opcode* opcode)
 {
     (void) opcode;
 
-    memset(state->display, 0, state->display_width * state->display_height);
+    chip8_clear_display(state);
     state->PC += 2;
     return CHIP8_OK;
 }
@@ -54,6 +69,38 @@ static Chip8Error exec_ret(Chip8 *state, Chip8Opcode* opcode)
     }
 }
 
+/**
+ * Whether the next iteration of an idle loop would load the values registers already hold,
+ * and reach the jump back again. The last iteration may have seen DT change, or not have run at all.
+ */
+static bool idle_loop_settled(Chip8 *state, uint16_t start, uint16_t end)
+{
+    for (uint16_t address = start; address < end; address += 2) {
+        Chip8Opcode opcode;
+        chip8_decode(state, &opcode, address);
+
+        uint8_t vx = state->registers[opcode.x];
+        uint8_t vy = state->registers[opcode.y];
+        bool key = state->keyboard[vx & 0xF];
+
+        bool settled =
+            opcode.id == OPCODE_LD_VX_DT ? vx == state->DT :
+            opcode.id == OPCODE_LD_VX_KK ? vx == opcode.kk :
+            opcode.id == OPCODE_SE_VX_KK ? vx != opcode.kk :
+            opcode.id == OPCODE_SNE_VX_KK ? vx == opcode.kk :
+            opcode.id == OPCODE_SE_VX_VY ? vx != vy :
+            opcode.id == OPCODE_SNE_VX_VY ? vx == vy :
+            opcode.id == OPCODE_SKP_VX ? !key :
+            opcode.id == OPCODE_SKNP_VX ? key :
+            false;
+
+        if (!settled)
+            return false;
+    }
+
+    return true;
+}
+
 /**
  * 1nnn - JP addr
  * Jump to location nnn.
@@ -62,6 +109,13 @@ static Chip8Error exec_ret(Chip8 *state, Chip8Opcode* opcode)
  */
 static Chip8Error exec_jmp_nnn(Chip8 *state, Chip8Opcode* opcode)
 {
+    // Idle loop: all iterations until cycles_limit would be the same, skip them (counting this cycle).
+    if (opcode->nnn <= state->PC && state->cycles_since_started + 1 < state->cycles_limit) {
+        uint32_t length = chip8_idle_loop(state, opcode->nnn, state->PC);
+        if (length && idle_loop_settled(state, opcode->nnn, state->PC))
+            state->cycles_since_started += (state->cycles_limit - state->cycles_since_started - 1) / length * length;
+    }
+
     state->PC = opcode->nnn;
     return CHIP8_OK;
 }
@@ -91,9 +145,9 @@ static Chip8Error exec_call_nnn(Chip8 *state, Chip8Opcode* opcode)
  *
  * The interpreter compares register Vx to kk, and if they are equal, increments the program counter by 2.
  */
-static Chip8Error exec_se_vx_kk(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_se_vx_kk(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
 {
-    state->PC += state->registers[opcode->x] == opcode->kk ? 4 : 2;
+    state->PC += state->registers[opcode->x] == opcode->kk ? 2 + next_length(state, variant) : 2;
     return CHIP8_OK;
 }
 
@@ -103,9 +157,9 @@ static Chip8Error exec_se_vx_kk(Chip8 *state, Chip8Opcode* opcode)
  *
  * The interpreter compares register Vx to kk, and if they are not equal, increments the program counter by 2.
  */
-static Chip8Error exec_sne_vx_kk(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_sne_vx_kk(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
 {
-    state->PC += state->registers[opcode->x] != opcode->kk ? 4 : 2;
+    state->PC += state->registers[opcode->x] != opcode->kk ? 2 + next_length(state, variant) : 2;
     return CHIP8_OK;
 }
 
@@ -115,9 +169,9 @@ static Chip8Error exec_sne_vx_kk(Chip8 *state, Chip8Opcode* opcode)
  *
  * The interpreter compares register Vx to register Vy, and if they are equal, increments the program counter by 2.
  */
-static Chip8Error exec_se_vx_vy(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_se_vx_vy(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
 {
-    state->PC += state->registers[opcode->x] == state->registers[opcode->y] ? 4 : 2;
+    state->PC += state->registers[opcode->x] == state->registers[opcode->y] ? 2 + next_length(state, variant) : 2;
     return CHIP8_OK;
 }
 
@@ -283,9 +337,9 @@ static Chip8Error exec_shl_vx_vy(Chip8 *state, Chip8Opcode* opcode)
  *
  * The values of Vx and Vy are compared, and if they are not equal, the program counter is increased by 2.
  */
-static Chip8Error exec_sne_vx_vy(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_sne_vx_vy(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
 {
-    state->PC += state->registers[opcode->x] != state->registers[opcode->y] ? 4 : 2;
+    state->PC += state->registers[opcode->x] != state->registers[opcode->y] ? 2 + next_length(state, variant) : 2;
     return CHIP8_OK;
 }
 
@@ -344,24 +398,7 @@ static Chip8Error exec_rnd_vx_kk(Chip8 *state, Chip8Opcode* opcode)
  */
 static Chip8Error exec_drw_vx_vy_n(Chip8 *state, Chip8Opcode* opcode)
 {
-    uint8_t x0 = state->registers[opcode->x];
-    uint8_t y0 = state->registers[opcode->y];
-    uint8_t n = opcode->n;
-    
-    state->registers[15] = 0;
-    for (int y = 0; y < n; ++y)
-    {
-        for (int x = 0; x < 8; ++x)
-        {
-            uint16_t position = (y0 + y) % state->display_height * state->display_width + (x0 + x) % state->display_width;
-            uint8_t new_pixel = 1 & (state->memory[state->I + y] >> (7 - x));
-
-            state->registers[15] |= new_pixel & state->display[position];
-            state->display[position] ^= new_pixel;
-        }
-    }
-
-    state->display_dirty = true;
+    chip8_draw_sprite(state, state->registers[opcode->x], state->registers[opcode->y], opcode->n);
     state->PC += 2;
     return CHIP8_OK;
 }
@@ -372,9 +409,9 @@ static Chip8Error exec_drw_vx_vy_n(Chip8 *state, Chip8Opcode* opcode)
  *
  * Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2.
  */
-static Chip8Error exec_skp_vx(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_skp_vx(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
 {
-    state->PC += state->keyboard[state->registers[opcode->x]] ? 4 : 2;
+    state->PC += state->keyboard[state->registers[opcode->x] & 0xF] ? 2 + next_length(state, variant) : 2;
     return CHIP8_OK;
 }
 
@@ -384,9 +421,9 @@ static Chip8Error exec_skp_vx(Chip8 *state, Chip8Opcode* opcode)
  *
  * Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2.
  */
-static Chip8Error exec_sknp_vx(Chip8 *state, Chip8Opcode* opcode)
+static Chip8Error exec_sknp_vx(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
 {
-    state->PC += state->keyboard[state->registers[opcode->x]] ? 2 : 4;
+    state->PC += state->keyboard[state->registers[opcode->x] & 0xF] ? 2 : 2 + next_length(state, variant);
     return CHIP8_OK;
 }
 
@@ -411,16 +448,16 @@ static Chip8Error exec_ld_vx_dt(Chip8 *state, Chip8Opcode* opcode)
  */
 static Chip8Error exec_ld_vx_k(Chip8 *state, Chip8Opcode* opcode)
 {
-    int i;
-    for (i = 0; i < 16; ++i)
-        if (state->keyboard[i])
-        {
-            state->registers[opcode->x] = i;
-            break;
-        }
+    int32_t key = chip8_pressed_key(state);
 
-    if (i != 16)
+    if (key != -1) {
+        state->registers[opcode->x] = key;
         state->PC += 2;
+    }
+    else if (state->cycles_since_started + 1 < state->cycles_limit) {
+        // Keys do not change until cycles_limit: skip the waiting, counting this cycle.
+        state->cycles_since_started = state->cycles_limit - 1;
+    }
 
     return CHIP8_OK;
 }
@@ -495,6 +532,8 @@ static Chip8Error exec_ld_b_vx(Chip8 *state, Chip8Opcode* opcode)
         remainder = remainder / 10;
     }
 
+    chip8_mark_written(state, state->I, 3);
+
     state->PC += 2;
     return CHIP8_OK;
 }
@@ -507,10 +546,13 @@ static Chip8Error exec_ld_b_vx(Chip8 *state, Chip8Opcode* opcode)
  */
 static Chip8Error exec_ld_i_vx(Chip8 *state, Chip8Opcode* opcode)
 {
+    uint16_t address = state->I;
     for (int i = 0; i <= opcode->x; ++i)
-        state->memory[state->I + i] = state->registers[i];
+        state->memory[address + i] = state->registers[i];
 
+    // Overwriting this very instruction decodes it again: opcode is not used after.
     state->I += opcode->x + 1;
+    chip8_mark_written(state, address, opcode->x + 1);
     state->PC += 2;
     return CHIP8_OK;
 }
@@ -531,53 +573,39 @@ static Chip8Error exec_ld_vx_i(Chip8 *state, Chip8Opcode* opcode)
     return CHIP8_OK;
 }
 
+/**
+ * 00CN - SCD nibble
+ * Scroll display N lines down.
+ */
 static Chip8Error exec_scrl_down_n(Chip8 *state, Chip8Opcode* opcode)
 {
-    int32_t offset = state->display_width * opcode->n;
-    int32_t size = state->display_width * state->display_height;
-
-    for (int32_t i = size - 1; i >= offset; --i)
-        state->display[i] = state->display[i - offset];
-
-    for (int32_t i = offset - 1; i >= 0; --i)
-        state->display[i] = 0;
-
+    chip8_scroll_display(state, 0, opcode->n);
     state->PC += 2;
     return CHIP8_OK;
 }
 
+/**
+ * 00FC - SCL
+ * Scroll display 4 pixels left.
+ */
 static Chip8Error exec_scrl_left(Chip8 *state, Chip8Opcode* opcode)
 {
     (void) opcode;
-    
-    uint32_t width = state->display_width;
-
-    for (uint32_t y = 0; y < state->display_height; ++y) {
-        for (uint32_t x = 0; x < width - 4; ++x)
-            state->display[x] = state->display[x + 4];
-
-        for (uint32_t x = width - 4; x < width; ++x)
-            state->display[x] = 0;
-    }
 
+    chip8_scroll_display(state, -4, 0);
     state->PC += 2;
     return CHIP8_OK;
 }
 
+/**
+ * 00FB - SCR
+ * Scroll display 4 pixels right.
+ */
 static Chip8Error exec_scrl_right(Chip8 *state, Chip8Opcode* opcode)
 {
     (void) opcode;
-    
-    uint32_t width = state->display_width;
-
-    for (uint32_t y = 0; y < state->display_height; ++y) {
-        for (uint32_t x = 0; x < 4; ++x)
-            state->display[x] = 0;
-
-        for (uint32_t x = 4; x < width; ++x)
-            state->display[x] = state->display[x - 4];
-    }
 
+    chip8_scroll_display(state, 4, 0);
     state->PC += 2;
     return CHIP8_OK;
 }
@@ -611,86 +639,266 @@ static Chip8Error exec_hidef_on(Chip8 *state, Chip8Opcode* opcode)
     return CHIP8_OK;
 }
 
+/**
+ * Dxy0 - DRW Vx, Vy, 0
+ * Draw a 16x16 sprite starting at memory location I at (Vx, Vy), set VF = collision.
+ */
 static Chip8Error exec_drw_vx_vy_0(Chip8* state, Chip8Opcode* opcode)
 {
-    return CHIP8_OPCODE_NOT_SUPPORTED;
+    chip8_draw_large_sprite(state, state->registers[opcode->x], state->registers[opcode->y]);
+    state->PC += 2;
+    return CHIP8_OK;
 }
 
+/**
+ * Fx30 - LD HF, Vx
+ * Set I = location of 10-byte sprite for digit Vx.
+ */
 static Chip8Error exec_ld_i_digit(Chip8 *state, Chip8Opcode* opcode)
 {
-    return CHIP8_OPCODE_NOT_SUPPORTED;
-}
-
-
-static Chip8Error (*exec_opcode[])(Chip8 *, Chip8Opcode*) = {
-    // Original
-    exec_invalid,       // OPCODE_INVALID
-    exec_cls,           // OPCODE_CLS
-    exec_ret,           // OPCODE_RET
-    exec_jmp_nnn,       // OPCODE_JMP_NNN
-    exec_call_nnn,      // OPCODE_CALL_NNN
-    exec_se_vx_kk,      // OPCODE_SE_VX_KK
-    exec_sne_vx_kk,     // OPCODE_SNE_VX_KK
-    exec_se_vx_vy,      // OPCODE_SE_VX_VY
-    exec_ld_vx_kk,      // OPCODE_LD_VX_KK
-    exec_add_vx_kk,     // OPCODE_ADD_VX_KK
-    exec_ld_vx_vy,      // OPCODE_LD_VX_VY
-    exec_or_vx_vy,      // OPCODE_OR_VX_VY
-    exec_and_vx_vy,     // OPCODE_AND_VX_VY
-    exec_xor_vx_vy,     // OPCODE_XOR_VX_VY
-    exec_add_vx_vy,     // OPCODE_ADD_VX_VY
-    exec_sub_vx_vy,     // OPCODE_SUB_VX_VY
-    exec_shr_vx_vy,     // OPCODE_SHR_VX_VY
-    exec_subn_vx_vy,    // OPCODE_SUBN_VX_VY
-    exec_shl_vx_vy,     // OPCODE_SHL_VX_VY
-    exec_sne_vx_vy,     // OPCODE_SNE_VX_VY
-    exec_ld_i_nnn,      // OPCODE_LD_I_NNN
-    exec_jp_v0_nnn,     // OPCODE_JP_V0_NNN
-    exec_rnd_vx_kk,     // OPCODE_RND_VX_KK
-    exec_drw_vx_vy_n,   // OPCODE_DRW_VX_VY_N
-    exec_skp_vx,        // OPCODE_SKP_VX
-    exec_sknp_vx,       // OPCODE_SKNP_VX
-    exec_ld_vx_dt,      // OPCODE_LD_VX_DT
-    exec_ld_vx_k,       // OPCODE_LD_VX_K
-    exec_ld_dt_vx,      // OPCODE_LD_DT_VX
-    exec_ld_st_vx,      // OPCODE_LD_ST_VX
-    exec_add_i_vx,      // OPCODE_ADD_I_VX
-    exec_ld_f_vx,       // OPCODE_LD_F_VX
-    exec_ld_b_vx,       // OPCODE_LD_B_VX
-    exec_ld_i_vx,       // OPCODE_LD_I_VX
-    exec_ld_vx_i,       // OPCODE_LD_VX_I
-
-    // S-Chip
-    exec_scrl_down_n,   // OPCODE_SCRL_DOWN_N
-    exec_scrl_left,     // OPCODE_SCRL_LEFT
-    exec_scrl_right,    // OPCODE_SCRL_RIGHT
-    exec_exit,          // OPCODE_EXIT
-    exec_hidef_off,     // OPCODE_HIDEF_OFF
-    exec_hidef_on,      // OPCODE_HIDEF_ON
-    exec_drw_vx_vy_0,   // OPCODE_DRW_VX_VY_0
-    exec_ld_i_digit,    // OPCODE_LD_I_DIGIT
-    exec_not_supported, // OPCODE_LD_RPL_VX
-    exec_not_supported, // OPCODE_LD_VX_RPL
-
-    // XO-Chip
-    exec_not_supported, // OPCODE_LD_I_VX_VY
-    exec_not_supported, // OPCODE_LD_VX_VY_I
-    exec_not_supported, // OPCODE_LD_I_NNNN
-    exec_not_supported, // OPCODE_DRW_PLN_N
-    exec_not_supported, // OPCODE_LD_AUDIO_I
-    exec_not_supported, // OPCODE_SCRL_UP_N
-};
+    state->I = CHIP8_LARGE_FONT + 10 * state->registers[opcode->x];
+    state->PC += 2;
+    return CHIP8_OK;
+}
+
+/**
+ * Fx75 - LD R, Vx
+ * Store V0 through Vx in RPL user flags.
+ */
+static Chip8Error exec_ld_rpl_vx(Chip8 *state, Chip8Opcode* opcode)
+{
+    for (int i = 0; i <= opcode->x; ++i)
+        state->rpl[i] = state->registers[i];
+
+    state->PC += 2;
+    return CHIP8_OK;
+}
+
+/**
+ * Fx85 - LD Vx, R
+ * Read V0 through Vx from RPL user flags.
+ */
+static Chip8Error exec_ld_vx_rpl(Chip8 *state, Chip8Opcode* opcode)
+{
+    for (int i = 0; i <= opcode->x; ++i)
+        state->registers[i] = state->rpl[i];
+
+    state->PC += 2;
+    return CHIP8_OK;
+}
+
+/**
+ * 5xy2 - LD [I], Vx - Vy
+ * Store Vx through Vy in memory starting at location I, in descending order when x > y. I is not modified.
+ */
+static Chip8Error exec_ld_i_vx_vy(Chip8 *state, Chip8Opcode* opcode)
+{
+    int step = opcode->x <= opcode->y ? 1 : -1;
+    int length = step * (opcode->y - opcode->x) + 1;
+
+    for (int i = 0; i < length; ++i)
+        state->memory[state->I + i] = state->registers[opcode->x + step * i];
+
+    chip8_mark_written(state, state->I, length);
+    state->PC += 2;
+    return CHIP8_OK;
+}
+
+/**
+ * 5xy3 - LD Vx - Vy, [I]
+ * Read Vx through Vy from memory starting at location I, in descending order when x > y. I is not modified.
+ */
+static Chip8Error exec_ld_vx_vy_i(Chip8 *state, Chip8Opcode* opcode)
+{
+    int step = opcode->x <= opcode->y ? 1 : -1;
+    int length = step * (opcode->y - opcode->x) + 1;
+
+    for (int i = 0; i < length; ++i)
+        state->registers[opcode->x + step * i] = state->memory[state->I + i];
+
+    state->PC += 2;
+    return CHIP8_OK;
+}
+
+/**
+ * F000 NNNN - LD I, long NNNN
+ * Set I = NNNN, this instruction is 4 bytes long.
+ */
+static Chip8Error exec_ld_i_nnnn(Chip8 *state, Chip8Opcode* opcode)
+{
+    (void) opcode;
+
+    state->I = state->memory[state->PC + 2] << 8 | state->memory[state->PC + 3];
+    state->PC += 4;
+    return CHIP8_OK;
+}
+
+/**
+ * FN01 - PLANE N
+ * Select display planes used by drawing, clearing and scrolling.
+ */
+static Chip8Error exec_drw_pln_n(Chip8 *state, Chip8Opcode* opcode)
+{
+    state->display_mask = opcode->x;
+    state->PC += 2;
+    return CHIP8_OK;
+}
+
+/**
+ * F002 - AUDIO
+ * Store 16 bytes starting at I in the audio pattern buffer.
+ */
+static Chip8Error exec_ld_audio_i(Chip8 *state, Chip8Opcode* opcode)
+{
+    (void) opcode;
+
+    memcpy(state->audio, state->memory + state->I, sizeof state->audio);
+    state->PC += 2;
+    return CHIP8_OK;
+}
 
+/**
+ * 00DN - SCU nibble
+ * Scroll display N lines up.
+ */
+static Chip8Error exec_scrl_up_n(Chip8 *state, Chip8Opcode* opcode)
+{
+    chip8_scroll_display(state, 0, -opcode->n);
+    state->PC += 2;
+    return CHIP8_OK;
+}
 
+
+/**
+ * Last opcode id a variant decodes to: each extension adds its opcodes after the ones it extends.
+ */
+static inline Chip8OpcodeId last_opcode(Chip8Variant variant)
+{
+    return
+        variant == VARIANT_XO_CHIP ? OPCODE_SCRL_UP_N :
+        variant == VARIANT_SUPER_CHIP ? OPCODE_LD_VX_RPL :
+        OPCODE_LD_VX_I;
+}
+
+/**
+ * Execute a decoded instruction.
+ * A switch rather than a table of handlers lets the compiler inline them into the run loop.
+ * When variant is a constant, handlers of opcodes it does not have are left out.
+ */
+static ALWAYS_INLINE Chip8Error execute(Chip8 *state, Chip8Opcode* opcode, Chip8Variant variant)
+{
+    if (opcode->id > last_opcode(variant))
+        return exec_invalid(state, opcode);
+
+    switch (opcode->id) {
+        // Original
+        case OPCODE_CLS: return exec_cls(state, opcode);
+        case OPCODE_RET: return exec_ret(state, opcode);
+        case OPCODE_JMP_NNN: return exec_jmp_nnn(state, opcode);
+        case OPCODE_CALL_NNN: return exec_call_nnn(state, opcode);
+        case OPCODE_SE_VX_KK: return exec_se_vx_kk(state, opcode, variant);
+        case OPCODE_SNE_VX_KK: return exec_sne_vx_kk(state, opcode, variant);
+        case OPCODE_SE_VX_VY: return exec_se_vx_vy(state, opcode, variant);
+        case OPCODE_LD_VX_KK: return exec_ld_vx_kk(state, opcode);
+        case OPCODE_ADD_VX_KK: return exec_add_vx_kk(state, opcode);
+        case OPCODE_LD_VX_VY: return exec_ld_vx_vy(state, opcode);
+        case OPCODE_OR_VX_VY: return exec_or_vx_vy(state, opcode);
+        case OPCODE_AND_VX_VY: return exec_and_vx_vy(state, opcode);
+        case OPCODE_XOR_VX_VY: return exec_xor_vx_vy(state, opcode);
+        case OPCODE_ADD_VX_VY: return exec_add_vx_vy(state, opcode);
+        case OPCODE_SUB_VX_VY: return exec_sub_vx_vy(state, opcode);
+        case OPCODE_SHR_VX_VY: return exec_shr_vx_vy(state, opcode);
+        case OPCODE_SUBN_VX_VY: return exec_subn_vx_vy(state, opcode);
+        case OPCODE_SHL_VX_VY: return exec_shl_vx_vy(state, opcode);
+        case OPCODE_SNE_VX_VY: return exec_sne_vx_vy(state, opcode, variant);
+        case OPCODE_LD_I_NNN: return exec_ld_i_nnn(state, opcode);
+        case OPCODE_JP_V0_NNN: return exec_jp_v0_nnn(state, opcode);
+        case OPCODE_RND_VX_KK: return exec_rnd_vx_kk(state, opcode);
+        case OPCODE_DRW_VX_VY_N: return exec_drw_vx_vy_n(state, opcode);
+        case OPCODE_SKP_VX: return exec_skp_vx(state, opcode, variant);
+        case OPCODE_SKNP_VX: return exec_sknp_vx(state, opcode, variant);
+        case OPCODE_LD_VX_DT: return exec_ld_vx_dt(state, opcode);
+        case OPCODE_LD_VX_K: return exec_ld_vx_k(state, opcode);
+        case OPCODE_LD_DT_VX: return exec_ld_dt_vx(state, opcode);
+        case OPCODE_LD_ST_VX: return exec_ld_st_vx(state, opcode);
+        case OPCODE_ADD_I_VX: return exec_add_i_vx(state, opcode);
+        case OPCODE_LD_F_VX: return exec_ld_f_vx(state, opcode);
+        case OPCODE_LD_B_VX: return exec_ld_b_vx(state, opcode);
+        case OPCODE_LD_I_VX: return exec_ld_i_vx(state, opcode);
+        case OPCODE_LD_VX_I: return exec_ld_vx_i(state, opcode);
+
+        // S-Chip
+        case OPCODE_SCRL_DOWN_N: return exec_scrl_down_n(state, opcode);
+        case OPCODE_SCRL_LEFT: return exec_scrl_left(state, opcode);
+        case OPCODE_SCRL_RIGHT: return exec_scrl_right(state, opcode);
+        case OPCODE_EXIT: return exec_exit(state, opcode);
+        case OPCODE_HIDEF_OFF: return exec_hidef_off(state, opcode);
+        case OPCODE_HIDEF_ON: return exec_hidef_on(state, opcode);
+        case OPCODE_DRW_VX_VY_0: return exec_drw_vx_vy_0(state, opcode);
+        case OPCODE_LD_I_DIGIT: return exec_ld_i_digit(state, opcode);
+        case OPCODE_LD_RPL_VX: return exec_ld_rpl_vx(state, opcode);
+        case OPCODE_LD_VX_RPL: return exec_ld_vx_rpl(state, opcode);
+
+        // XO-Chip
+        case OPCODE_LD_I_VX_VY: return exec_ld_i_vx_vy(state, opcode);
+        case OPCODE_LD_VX_VY_I: return exec_ld_vx_vy_i(state, opcode);
+        case OPCODE_LD_I_NNNN: return exec_ld_i_nnnn(state, opcode);
+        case OPCODE_DRW_PLN_N: return exec_drw_pln_n(state, opcode);
+        case OPCODE_LD_AUDIO_I: return exec_ld_audio_i(state, opcode);
+        case OPCODE_SCRL_UP_N: return exec_scrl_up_n(state, opcode);
+
+        default: return exec_invalid(state, opcode);
+    }
+}
+
+/**
+ * Other engines fall back to this for single instructions. Their stores do not all
+ * go through chip8_mark_written: the instruction is decoded from memory every time.
+ */
 Chip8Error interpreter_step(Chip8 *state)
 {
     Chip8Opcode opcode;
     chip8_decode(state, &opcode, state->PC);
 
-    Chip8Error error = exec_opcode[opcode.id](state, &opcode);
+    Chip8Error error = execute(state, &opcode, state->variant);
     if (error != CHIP8_OK)
         return error;
 
     state->cycles_since_started++;
     return CHIP8_OK;
 }
+
+/**
+ * Run loop of one variant.
+ * The variant is a constant there: checks for other variants fold away, and so do handlers of opcodes it does not have.
+ */
+#define DEFINE_RUN(name, variant)                                           \
+    static Chip8Error name(Chip8 *state)                                    \
+    {                                                                       \
+        do {                                                                \
+            Chip8Opcode* opcode = &state->decoded[state->PC];               \
+            Chip8Error error = execute(state, opcode, variant);             \
+            if (error != CHIP8_OK)                                          \
+                return error;                                               \
+        } while (++state->cycles_since_started < state->cycles_limit);      \
+                                                                            \
+        return CHIP8_OK;                                                    \
+    }
+
+DEFINE_RUN(run_chip8, VARIANT_CHIP8)
+DEFINE_RUN(run_two_pages, VARIANT_TWO_PAGES)
+DEFINE_RUN(run_super_chip, VARIANT_SUPER_CHIP)
+DEFINE_RUN(run_xo_chip, VARIANT_XO_CHIP)
+
+Chip8Error interpreter_run(Chip8 *state)
+{
+    if (!state->decoded)
+        chip8_predecode(state);
+
+    switch (state->variant) {
+        case VARIANT_CHIP8: return run_chip8(state);
+        case VARIANT_TWO_PAGES: return run_two_pages(state);
+        case VARIANT_SUPER_CHIP: return run_super_chip(state);
+        default: return run_xo_chip(state);
+    }
+}
@@ -1,4 +1,9 @@
 #pragma once
 #include "../chip8.h"
 
+// Execute the instruction at PC.
 Chip8Error interpreter_step(Chip8 *state);
+
+// Execute instructions until cycles_limit (at least one), or an error.
+// Instructions are decoded ahead: memory written since must go through chip8_mark_written.
+Chip8Error interpreter_run(Chip8 *state);
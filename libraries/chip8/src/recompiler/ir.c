@@ -0,0 +1,388 @@
+#include <string.h>
+#include "ir.h"
+
+#define BIT(x) (1u << (x))
+
+bool ir_is_skip(const Chip8Opcode* opcode) {
+    return opcode->id == OPCODE_SE_VX_KK
+        || opcode->id == OPCODE_SNE_VX_KK
+        || opcode->id == OPCODE_SE_VX_VY
+        || opcode->id == OPCODE_SNE_VX_VY
+        || opcode->id == OPCODE_SKP_VX
+        || opcode->id == OPCODE_SKNP_VX;
+}
+
+bool ir_ends_block(const Chip8Opcode* opcode) {
+    return opcode->id == OPCODE_INVALID
+        || opcode->id == OPCODE_RET
+        || opcode->id == OPCODE_JMP_NNN
+        || opcode->id == OPCODE_CALL_NNN
+        || opcode->id == OPCODE_JP_V0_NNN
+        || opcode->id == OPCODE_EXIT;
+}
+
+/**
+ * Registers read and written by an instruction.
+ * Instructions which may leave the block, or call C code, read and write all of them.
+ */
+static void get_accesses(const Chip8Opcode* opcode, uint32_t* reads, uint32_t* writes) {
+    uint32_t x = BIT(opcode->x), y = BIT(opcode->y);
+
+    switch (opcode->id) {
+        case OPCODE_LD_VX_KK:   *reads = 0;         *writes = x; break;
+        case OPCODE_ADD_VX_KK:  *reads = x;         *writes = x; break;
+        case OPCODE_LD_VX_VY:   *reads = y;         *writes = x; break;
+        case OPCODE_OR_VX_VY:
+        case OPCODE_AND_VX_VY:
+        case OPCODE_XOR_VX_VY:  *reads = x | y;     *writes = x; break;
+        case OPCODE_ADD_VX_VY:
+        case OPCODE_SUB_VX_VY:
+        case OPCODE_SUBN_VX_VY: *reads = x | y;     *writes = x | BIT(15); break;
+        case OPCODE_SHR_VX_VY:
+        case OPCODE_SHL_VX_VY:  *reads = x;         *writes = x | BIT(15); break;
+        case OPCODE_LD_I_NNN:   *reads = 0;         *writes = IR_I; break;
+        case OPCODE_ADD_I_VX:   *reads = x | IR_I;  *writes = IR_I; break;
+
+        // Instructions without effect on registers, which never leave the block.
+        case OPCODE_SE_VX_KK:
+        case OPCODE_SNE_VX_KK:
+        case OPCODE_SKP_VX:
+        case OPCODE_SKNP_VX:
+        case OPCODE_LD_DT_VX:
+        case OPCODE_LD_ST_VX:   *reads = x;         *writes = 0; break;
+        case OPCODE_SE_VX_VY:
+        case OPCODE_SNE_VX_VY:  *reads = x | y;     *writes = 0; break;
+
+        default:                *reads = IR_ALL;    *writes = IR_ALL; break;
+    }
+}
+
+/** Whether an instruction only computes registers, and can be dropped when they are not used. */
+static bool is_pure(const IrInstruction* instruction) {
+    return instruction->writes && instruction->writes != IR_ALL;
+}
+
+/** Whether an instruction may leave the block, or let C code read registers. */
+static bool is_exit(const IrInstruction* instruction) {
+    return instruction->reads == IR_ALL;
+}
+
+static bool is_known(const IrFacts* facts, uint8_t x) {
+    return facts->known & BIT(x);
+}
+
+static void set(IrFacts* facts, uint8_t x, uint8_t value) {
+    facts->known |= BIT(x);
+    facts->values[x] = value;
+}
+
+/**
+ * Apply the effect of an instruction on what is known about registers.
+ * Results follow the generated code, flags are only computed when VF is not an operand.
+ */
+static void evaluate(const Chip8Opcode* opcode, uint32_t writes, IrFacts* facts) {
+    uint8_t x = opcode->x, y = opcode->y;
+    bool known_x = is_known(facts, x), known_y = is_known(facts, y), known_i = facts->known & IR_I;
+    uint8_t vx = facts->values[x], vy = facts->values[y];
+
+    // Forget what is written, and set what can be computed.
+    facts->known &= ~writes;
+
+    switch (opcode->id) {
+        case OPCODE_LD_VX_KK:
+            set(facts, x, opcode->kk);
+            break;
+
+        case OPCODE_ADD_VX_KK:
+            if (known_x) set(facts, x, vx + opcode->kk);
+            break;
+
+        case OPCODE_LD_VX_VY:
+            if (known_y) set(facts, x, vy);
+            break;
+
+        case OPCODE_OR_VX_VY:
+            if (known_x && known_y) set(facts, x, vx | vy);
+            break;
+
+        case OPCODE_AND_VX_VY:
+            if (known_x && known_y) set(facts, x, vx & vy);
+            break;
+
+        case OPCODE_XOR_VX_VY:
+            if (known_x && known_y) set(facts, x, vx ^ vy);
+            break;
+
+        case OPCODE_ADD_VX_VY:
+            if (known_x && known_y && x != 15 && y != 15) {
+                set(facts, x, vx + vy);
+                set(facts, 15, vx + vy > 255);
+            }
+            break;
+
+        case OPCODE_SHR_VX_VY:
+            if (known_x && x != 15) {
+                set(facts, x, vx >> 1);
+                set(facts, 15, vx & 1);
+            }
+            break;
+
+        case OPCODE_SHL_VX_VY:
+            if (known_x && x != 15) {
+                set(facts, x, vx << 1);
+                set(facts, 15, vx >> 7);
+            }
+            break;
+
+        case OPCODE_LD_I_NNN:
+            facts->known |= IR_I;
+            facts->i = opcode->nnn;
+            break;
+
+        case OPCODE_ADD_I_VX:
+            if (known_x && known_i) {
+                facts->known |= IR_I;
+                facts->i += vx;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/** Keep what is known on both paths, after an instruction which may or may not run. */
+static void meet(IrFacts* facts, const IrFacts* other) {
+    for (uint8_t x = 0; x < 16; ++x)
+        if (facts->values[x] != other->values[x])
+            facts->known &= ~BIT(x);
+
+    if (facts->i != other->i)
+        facts->known &= ~IR_I;
+
+    facts->known &= other->known;
+}
+
+/** Decide a skip from known registers, for instructions which are sure to run. */
+static IrSkip decide_skip(const IrInstruction* instruction) {
+    const Chip8Opcode* opcode = &instruction->opcode;
+    const IrFacts* facts = &instruction->before;
+    uint8_t vx = facts->values[opcode->x], vy = facts->values[opcode->y];
+
+    if (instruction->conditional || !is_known(facts, opcode->x))
+        return IR_SKIP_RUNTIME;
+
+    switch (opcode->id) {
+        case OPCODE_SE_VX_KK:
+            return vx == opcode->kk ? IR_SKIP_ALWAYS : IR_SKIP_NEVER;
+
+        case OPCODE_SNE_VX_KK:
+            return vx != opcode->kk ? IR_SKIP_ALWAYS : IR_SKIP_NEVER;
+
+        case OPCODE_SE_VX_VY:
+            if (!is_known(facts, opcode->y)) return IR_SKIP_RUNTIME;
+            return vx == vy ? IR_SKIP_ALWAYS : IR_SKIP_NEVER;
+
+        case OPCODE_SNE_VX_VY:
+            if (!is_known(facts, opcode->y)) return IR_SKIP_RUNTIME;
+            return vx != vy ? IR_SKIP_ALWAYS : IR_SKIP_NEVER;
+
+        default:
+            return IR_SKIP_RUNTIME;
+    }
+}
+
+/** Whether a jump target was not decoded yet: loops are left to the translator. */
+static bool is_new(const IrBlock* block, uint16_t address) {
+    for (uint32_t i = 0; i < block->count; ++i)
+        if (block->instructions[i].address == address)
+            return false;
+
+    return true;
+}
+
+/**
+ * Whether the subroutine at address returns within IR_INLINE_MAX instructions,
+ * without jumping or calling another one on the way.
+ */
+static bool is_inlinable(Chip8* state, uint16_t address, uint32_t mem_size) {
+    bool after_skip = false;
+
+    for (uint32_t i = 0; i <= IR_INLINE_MAX && address + 1u < mem_size; ++i) {
+        Chip8Opcode opcode;
+        chip8_decode(state, &opcode, address);
+
+        if (ir_ends_block(&opcode) && !after_skip)
+            return opcode.id == OPCODE_RET;
+
+        address += opcode.id == OPCODE_LD_I_NNNN ? 4 : 2;
+        after_skip = ir_is_skip(&opcode);
+    }
+
+    return false;
+}
+
+/**
+ * Whether the jump at address, which follows a skip, runs more often than it is skipped.
+ * The skip can then leave the block, which goes on with the target of the jump.
+ */
+static bool is_hot_jump(const IrBlock* block, Chip8* state, uint16_t address, uint32_t mem_size, const uint16_t* heat) {
+    if (!heat || address + 3u >= mem_size || heat[address] <= heat[address + 2])
+        return false;
+
+    Chip8Opcode opcode;
+    chip8_decode(state, &opcode, address);
+    return opcode.id == OPCODE_JMP_NNN && is_new(block, opcode.nnn);
+}
+
+static void follow(IrInstruction* instruction, uint16_t target, uint32_t reads) {
+    instruction->followed = true;
+    instruction->target = target;
+    instruction->reads = reads;
+    instruction->writes = 0;
+}
+
+/**
+ * Pass 1: decode instructions along the path of the block, until one leaves it.
+ */
+static void decode(IrBlock* block, Chip8* state, uint16_t address, uint32_t length, const uint16_t* heat) {
+    uint32_t mem_size = state->variant == VARIANT_XO_CHIP ? 65536 : 4096;
+    bool after_skip = false;
+    uint32_t followed = 0;
+    int32_t returning = -1; // Return address while decoding an inlined subroutine.
+
+    block->count = 0;
+    while (address + 1u < mem_size && block->count < length && block->count < IR_INSTRUCTIONS_MAX) {
+        IrInstruction* instruction = &block->instructions[block->count++];
+        memset(instruction, 0, sizeof *instruction);
+        instruction->address = address;
+        chip8_decode(state, &instruction->opcode, address);
+        get_accesses(&instruction->opcode, &instruction->reads, &instruction->writes);
+
+        // F000 NNNN is followed by its operand.
+        const Chip8Opcode* opcode = &instruction->opcode;
+        uint16_t next = address + (opcode->id == OPCODE_LD_I_NNNN ? 4 : 2);
+
+        // Instructions after a skip may not run: the block cannot continue at their target.
+        if (!after_skip && followed < IR_FOLLOW_MAX) {
+            if (opcode->id == OPCODE_JMP_NNN && is_new(block, opcode->nnn))
+                follow(instruction, opcode->nnn, 0);
+
+            // The call stack may be full, which leaves the block with an error.
+            else if (opcode->id == OPCODE_CALL_NNN && returning < 0 && followed + 2 <= IR_FOLLOW_MAX
+                    && is_inlinable(state, opcode->nnn, mem_size)) {
+                follow(instruction, opcode->nnn, IR_ALL);
+                returning = next;
+            }
+
+            else if (opcode->id == OPCODE_RET && returning >= 0) {
+                follow(instruction, returning, 0);
+                returning = -1;
+            }
+
+            // Skipping the jump leaves the block, past the jump.
+            else if (ir_is_skip(opcode) && returning < 0 && is_hot_jump(block, state, next, mem_size, heat)) {
+                instruction->followed = true;
+                instruction->target = next + 2;
+                instruction->reads = IR_ALL;
+                after_skip = false;
+                address = next;
+                continue;
+            }
+        }
+
+        if (instruction->followed) {
+            followed++;
+            after_skip = false;
+            address = instruction->target;
+            continue;
+        }
+
+        // Instruction just after a skip cannot be the end of a block.
+        if (ir_ends_block(opcode) && !after_skip)
+            break;
+
+        address = next;
+        after_skip = ir_is_skip(opcode);
+    }
+}
+
+/**
+ * Pass 2: propagate constants, and decide skips which only depend on them.
+ * This folds chains of LD Vx, kk / ADD Vx, kk and LD I, nnn / ADD I, Vx into constants.
+ */
+static void propagate_constants(IrBlock* block) {
+    IrFacts facts;
+    memset(&facts, 0, sizeof facts);
+
+    IrSkip previous = IR_SKIP_NEVER;
+    for (uint32_t i = 0; i < block->count; ++i) {
+        IrInstruction* instruction = &block->instructions[i];
+        instruction->before = facts;
+        instruction->conditional = previous == IR_SKIP_RUNTIME;
+        instruction->skipped = previous == IR_SKIP_ALWAYS;
+
+        previous = IR_SKIP_NEVER;
+        if (instruction->skipped)
+            continue;
+
+        // The path of the block goes on with the next instruction, skipping it leaves the block.
+        if (instruction->followed && ir_is_skip(&instruction->opcode))
+            instruction->skip = decide_skip(instruction) == IR_SKIP_NEVER ? IR_SKIP_NEVER : IR_SKIP_RUNTIME;
+
+        // The skipped instruction must be analyzed to be dropped.
+        else if (ir_is_skip(&instruction->opcode)) {
+            instruction->skip = decide_skip(instruction);
+            if (instruction->skip == IR_SKIP_ALWAYS && i + 1 == block->count)
+                instruction->skip = IR_SKIP_RUNTIME;
+
+            previous = instruction->skip;
+        }
+
+        instruction->result = facts;
+        evaluate(&instruction->opcode, instruction->writes, &instruction->result);
+        instruction->folded = is_pure(instruction) && (instruction->result.known & instruction->writes) == instruction->writes;
+
+        if (instruction->conditional)
+            meet(&facts, &instruction->result);
+        else
+            facts = instruction->result;
+    }
+}
+
+/**
+ * Pass 3: drop instructions whose results are overwritten before being read.
+ * Registers which are live after each instruction also tell which flags need to be computed.
+ * Loads of registers which stay in host registers are already done once per block by the allocator.
+ */
+static void eliminate_dead_stores(IrBlock* block) {
+    uint32_t live = IR_ALL;
+
+    for (uint32_t i = block->count; i > 0; --i) {
+        IrInstruction* instruction = &block->instructions[i - 1];
+        instruction->live = live;
+        if (instruction->skipped)
+            continue;
+
+        if (is_exit(instruction)) {
+            live = IR_ALL;
+            continue;
+        }
+
+        instruction->dead = is_pure(instruction) && (instruction->writes & live) == 0;
+        if (instruction->dead)
+            continue;
+
+        // Registers written by an instruction which may not run keep their previous value.
+        if (!instruction->conditional)
+            live &= ~instruction->writes;
+
+        live |= instruction->reads;
+    }
+}
+
+void ir_build(IrBlock* block, Chip8* state, uint16_t address, uint32_t length, const uint16_t* heat) {
+    decode(block, state, address, length, heat);
+    propagate_constants(block);
+    eliminate_dead_stores(block);
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "../chip8.h"
+
+/** Maximum number of instructions of a block which are analyzed */
+#define IR_INSTRUCTIONS_MAX 64
+
+/** Maximum number of jumps, calls and returns a block continues through */
+#define IR_FOLLOW_MAX 7
+
+/** Longest subroutine inlined in the caller, in instructions before its RET */
+#define IR_INLINE_MAX 16
+
+/** Bit of I in masks of registers, next to the guest registers V0..VF */
+#define IR_I (1 << 16)
+
+/** Every guest register and I */
+#define IR_ALL (IR_I | 0xFFFF)
+
+/** What is known about registers at some point of a block. */
+typedef struct {
+    uint32_t known; // Registers whose value is known (V0..VF, and IR_I).
+    uint8_t values[16];
+    uint16_t i;
+} IrFacts;
+
+/** Outcome of a skip instruction, when it can be decided at translation time */
+typedef enum {
+    IR_SKIP_RUNTIME,
+    IR_SKIP_ALWAYS,
+    IR_SKIP_NEVER,
+} IrSkip;
+
+typedef struct {
+    Chip8Opcode opcode;
+    uint16_t address;
+
+    uint32_t reads;   // Registers the instruction reads.
+    uint32_t writes;  // Registers the instruction writes.
+    uint32_t live;    // Registers read after the instruction, before being overwritten.
+
+    IrFacts before;   // Facts when the instruction starts.
+    IrFacts result;   // Facts once the instruction ran.
+
+    bool conditional; // Follows a skip decided at runtime.
+    bool skipped;     // Follows a skip which is always taken: never runs.
+    bool folded;      // All the registers it writes are known: it can be replaced by constants.
+    bool dead;        // Only writes registers which are overwritten before being read: it can be dropped.
+    IrSkip skip;
+
+    // Jump, call or return which continues the block at target, instead of leaving it.
+    // For skips, the block goes on with the next instruction and skipping it leaves towards target.
+    bool followed;
+    uint16_t target;
+} IrInstruction;
+
+/**
+ * Intermediate representation of a block, on which optimization passes run before x64 is emitted.
+ *
+ * Instructions are analyzed up to the first one which leaves the block, or up to a length.
+ * Registers are unknown when entering the block, and everything is considered read when leaving it.
+ *
+ * Instructions follow the path the block takes, which is not contiguous in memory: unconditional jumps
+ * are followed, small subroutines are inlined, and skips in front of a jump can be turned into an exit
+ * when the jump is the hot path.
+ */
+typedef struct {
+    uint32_t count;
+    IrInstruction instructions[IR_INSTRUCTIONS_MAX];
+} IrBlock;
+
+/**
+ * Decode the block starting at address, and run optimization passes on it.
+ * Instructions past length are ignored: the block must not continue past them.
+ * heat counts how many times each address was interpreted, it decides the path of skips. It can be NULL.
+ */
+void ir_build(IrBlock* block, Chip8* state, uint16_t address, uint32_t length, const uint16_t* heat);
+
+// Whether an instruction conditionally skips the next one.
+bool ir_is_skip(const Chip8Opcode* opcode);
+
+// Whether an instruction always leaves the block.
+bool ir_ends_block(const Chip8Opcode* opcode);
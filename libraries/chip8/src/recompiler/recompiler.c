@@ -1,23 +1,699 @@
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "recompiler.h"
 
+/**
+ * Guards the registry and the cache directory.
+ * Machines running different ROMs can attach to and release caches from different threads.
+ */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Shared caches, which machines loading a ROM look into. */
+static RecompilerCache* registry = NULL;
+
+/** Directory where shared caches are saved, NULL when disabled. */
+static char* directory = NULL;
+
+/** Guards the perf map, which blocks translated on any thread are written to. */
+static pthread_mutex_t perf_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Symbols of translated blocks for perf, NULL when disabled. */
+static FILE* perf_map = NULL;
+
+/**
+ * Incremented when translated code of any cache may become stale or get released.
+ * Returns predicted into that code must then be forgotten by all machines.
+ */
+static atomic_uint dropped = 1;
+
+static void drop_code(void) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+}
+
+/**
+ * Header of the file of a shared cache.
+ * It is followed by the memory blocks were translated from, then by each block and its code.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t layout; // Size of structures which are saved as is, or accessed by translated code.
+    uint32_t variant;
+    uint32_t memory_size;
+    uint32_t blocks_count;
+} CacheFileHeader;
+
+#define CACHE_FILE_MAGIC "C8JT"
+#define CACHE_FILE_LAYOUT ((uint32_t) (sizeof(Chip8) << 16 | sizeof(CodeCache)))
+
 Chip8Error recompiler_init(RecompilerState* repository) {
     memset(repository, 0, sizeof *repository);
 
     return CHIP8_OK;
 }
 
+/**
+ * Shared caches are added to the registry, whose mutex must be held.
+ */
+static RecompilerCache* create_cache(Chip8* state, bool shared) {
+    RecompilerCache* cache = (RecompilerCache*) calloc(1, sizeof(RecompilerCache));
+    x64_arena_init(&cache->arena, CODE_ARENA_SIZE);
+    cache->pool = (CodeCache*) malloc(4096 * sizeof(CodeCache));
+    cache->references = 1;
+    cache->variant = state->variant;
+
+    if (shared) {
+        cache->shared = true;
+        cache->memory_size = state->variant == VARIANT_XO_CHIP ? 65536 : 4096;
+        cache->memory = (uint8_t*) malloc(cache->memory_size);
+        memcpy(cache->memory, state->memory, cache->memory_size);
+
+        cache->next = registry;
+        registry = cache;
+    }
+
+    return cache;
+}
+
+/**
+ * Remove a cache from the registry, so that it only belongs to the machines using it.
+ */
+static void unregister_cache(RecompilerCache* cache) {
+    if (!cache->shared)
+        return;
+
+    pthread_mutex_lock(&registry_mutex);
+    for (RecompilerCache** it = &registry; *it; it = &(*it)->next) {
+        if (*it == cache) {
+            *it = cache->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    free(cache->memory);
+    cache->memory = NULL;
+    cache->shared = false;
+}
+
+/**
+ * Whether blocks can start at address: caches only cover the first 4KB of memory, XO-Chip code above is interpreted.
+ */
+static bool translatable(uint32_t address) {
+    return address < 4096;
+}
+
+/**
+ * Patch the pending links of a block which point to another one.
+ */
+static void link_blocks(CodeCache* from, CodeCache* to) {
+    for (uint8_t i = 0; i < from->links_count; ++i) {
+        CodeLink* link = &from->links[i];
+
+        if (!link->linked && link->target == to->start) {
+            x64_link(&from->code, link->slot, to->code.buffer + to->entry);
+            link->linked = true;
+        }
+    }
+}
+
+/**
+ * Chain a newly translated block with all the blocks it exits to,
+ * and with all blocks which were waiting for it.
+ */
+static void link_block(RecompilerCache* repository, CodeCache* cache) {
+    for (uint8_t i = 0; i < cache->links_count; ++i) {
+        uint16_t address = cache->links[i].target;
+        CodeCache* target = translatable(address) ? repository->caches[address] : NULL;
+        if (target)
+            link_blocks(cache, target);
+    }
+
+    for (uint32_t pc = 0; pc < 4096; ++pc) {
+        CodeCache* other = repository->caches[pc];
+        if (other && other != cache)
+            link_blocks(other, cache);
+    }
+}
+
+/**
+ * Revert the links of a block which point to another one.
+ */
+static void unlink_blocks(CodeCache* from, CodeCache* to) {
+    for (uint8_t i = 0; i < from->links_count; ++i) {
+        CodeLink* link = &from->links[i];
+
+        if (link->linked && link->target == to->start) {
+            x64_unlink(&from->code, link->slot);
+            link->linked = false;
+        }
+    }
+}
+
+/**
+ * Whether a block was translated from memory between start and end.
+ */
+static bool covers(CodeCache* cache, uint32_t start, uint32_t end) {
+    for (uint8_t i = 0; i < cache->ranges_count; ++i)
+        if (cache->ranges[i].start < end && start < cache->ranges[i].end)
+            return true;
+
+    return false;
+}
+
+/**
+ * Whether code a block was translated from is the same in two memories.
+ */
+static bool same_code(CodeCache* cache, const uint8_t* memory, const uint8_t* other) {
+    for (uint8_t i = 0; i < cache->ranges_count; ++i) {
+        CodeRange* range = &cache->ranges[i];
+        if (memcmp(memory + range->start, other + range->start, range->end - range->start))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Name the code of a block after the CHIP-8 code it runs, so that perf attributes samples to it.
+ * Arenas get reused once flushed: perf resolves addresses with the last entry covering them.
+ */
+static void write_perf_symbol(RecompilerCache* repository, CodeCache* cache) {
+    static const char* variants[] = { "CHIP-8", "CHIP-8 two pages", "SUPER-CHIP", "XO-CHIP" };
+
+    pthread_mutex_lock(&perf_map_mutex);
+    if (perf_map)
+        fprintf(perf_map, "%" PRIxPTR " %" PRIx32 " %s %03X-%03X\n",
+            (uintptr_t) cache->code.buffer, cache->code.buffer_size, variants[repository->variant], cache->start, cache->end);
+    pthread_mutex_unlock(&perf_map_mutex);
+}
+
+static void add_block(RecompilerCache* repository, CodeCache* cache) {
+    write_perf_symbol(repository, cache);
+
+    repository->caches[cache->start] = cache;
+    repository->unsaved = true;
+    if (repository->shared)
+        repository->added[repository->added_count++] = cache->start;
+
+    for (uint8_t i = 0; i < cache->ranges_count; ++i) {
+        uint32_t last_page = (cache->ranges[i].end - 1) >> CHIP8_PAGE_SHIFT;
+        for (uint32_t page = cache->ranges[i].start >> CHIP8_PAGE_SHIFT; page <= last_page; ++page)
+            if (repository->page_blocks[page]++ == 0)
+                repository->code_pages[page] = 1;
+    }
+}
+
+static void remove_block(RecompilerCache* repository, CodeCache* cache) {
+    drop_code();
+
+    for (uint32_t pc = 0; pc < 4096; ++pc) {
+        CodeCache* other = repository->caches[pc];
+        if (other && other != cache)
+            unlink_blocks(other, cache);
+    }
+
+    for (uint8_t i = 0; i < cache->ranges_count; ++i) {
+        uint32_t last_page = (cache->ranges[i].end - 1) >> CHIP8_PAGE_SHIFT;
+        for (uint32_t page = cache->ranges[i].start >> CHIP8_PAGE_SHIFT; page <= last_page; ++page)
+            if (--repository->page_blocks[page] == 0)
+                repository->code_pages[page] = 0;
+    }
+
+    // Code stays in the arena until next flush.
+    repository->caches[cache->start] = NULL;
+}
+
+/**
+ * Drop all blocks, and start over with an empty arena.
+ */
+static void flush(RecompilerCache* repository) {
+    drop_code();
+    memset(repository->caches, 0, sizeof repository->caches);
+    memset(repository->page_blocks, 0, sizeof repository->page_blocks);
+    memset(repository->code_pages, 0, sizeof repository->code_pages);
+    repository->added_count = 0;
+    repository->generation++;
+    x64_arena_reset(&repository->arena);
+}
+
+/**
+ * Drop all blocks which were overwritten since last step.
+ */
+static void invalidate_written(RecompilerCache* repository, Chip8* state) {
+    for (uint32_t pc = 0; pc < 4096; ++pc) {
+        CodeCache* cache = repository->caches[pc];
+        if (cache && covers(cache, state->written_start, state->written_end))
+            remove_block(repository, cache);
+    }
+
+    state->written_start = state->written_end = 0;
+}
+
+/**
+ * FNV-1a hash of memory, which names the file of a cache.
+ */
+static uint64_t hash_memory(const uint8_t* memory, uint32_t size) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint32_t i = 0; i < size; ++i)
+        hash = (hash ^ memory[i]) * 0x100000001b3;
+
+    return hash;
+}
+
+/**
+ * Name of the file of a cache in the directory, the registry mutex must be held.
+ */
+static bool cache_path(RecompilerCache* cache, char* path, size_t size) {
+    int length = snprintf(
+        path, size, "%s/%016" PRIx64 "-%d-v%d.jit",
+        directory, hash_memory(cache->memory, cache->memory_size), (int) cache->variant, TRANSLATE_VERSION);
+
+    return length > 0 && (size_t) length < size;
+}
+
+/**
+ * Write the blocks of a shared cache in the cache directory, so that next runs of the ROM can use them.
+ */
+static void save_cache(RecompilerCache* cache) {
+    char path[4096], temporary[4096 + 4];
+    if (!cache->shared || !cache->unsaved)
+        return;
+
+    pthread_mutex_lock(&registry_mutex);
+    bool named = directory && cache_path(cache, path, sizeof path);
+    pthread_mutex_unlock(&registry_mutex);
+    if (!named)
+        return;
+
+    // Write a temporary file first, so that other processes never load a partial one.
+    snprintf(temporary, sizeof temporary, "%s.tmp", path);
+    FILE* f = fopen(temporary, "wb");
+    if (!f)
+        return;
+
+    CacheFileHeader header = {
+        CACHE_FILE_MAGIC, TRANSLATE_VERSION, CACHE_FILE_LAYOUT, cache->variant, cache->memory_size, 0
+    };
+    for (uint32_t pc = 0; pc < 4096; ++pc)
+        if (cache->caches[pc])
+            header.blocks_count++;
+
+    bool ok = fwrite(&header, sizeof header, 1, f) == 1 && fwrite(cache->memory, cache->memory_size, 1, f) == 1;
+
+    for (uint32_t pc = 0; ok && pc < 4096; ++pc) {
+        if (!cache->caches[pc])
+            continue;
+
+        // Links target the arena of this process, they are patched again after loading.
+        uint8_t code[CODE_BUFFER_SIZE];
+        CodeCache block = *cache->caches[pc];
+        memcpy(code, block.code.buffer, block.code.buffer_size);
+        block.code.buffer = code;
+
+        for (uint8_t i = 0; i < block.links_count; ++i) {
+            if (block.links[i].linked)
+                x64_unlink(&block.code, block.links[i].slot);
+            block.links[i].linked = false;
+        }
+
+        ok = fwrite(&block, sizeof block, 1, f) == 1 && fwrite(code, block.code.buffer_size, 1, f) == 1;
+    }
+
+    ok = fclose(f) == 0 && ok;
+    if (ok)
+        rename(temporary, path);
+    else
+        remove(temporary);
+
+    cache->unsaved = false;
+}
+
+/**
+ * Whether a saved block can be copied into the arena without writing out of bounds.
+ */
+static bool is_loadable(RecompilerCache* cache, CodeCache* block) {
+    if (block->start >= 4096 || block->ranges_count == 0 || block->ranges_count > CODE_RANGES_MAX)
+        return false;
+
+    for (uint8_t i = 0; i < block->ranges_count; ++i)
+        if (block->ranges[i].start >= block->ranges[i].end || block->ranges[i].end > cache->memory_size)
+            return false;
+
+    if (block->code.buffer_size > CODE_BUFFER_SIZE || block->entry >= block->code.buffer_size
+        || block->links_count > CODE_LINKS_MAX || block->calls_count > CODE_CALLS_MAX)
+        return false;
+
+    for (uint8_t i = 0; i < block->links_count; ++i)
+        if (block->links[i].slot + X64_LINK_SLOT_SIZE > block->code.buffer_size || block->links[i].linked
+            || !translatable(block->links[i].target))
+            return false;
+
+    for (uint8_t i = 0; i < block->calls_count; ++i)
+        if (block->calls[i].offset + 8u > block->code.buffer_size)
+            return false;
+
+    return true;
+}
+
+/**
+ * Add the blocks saved in the cache directory to a new shared cache, the registry mutex must be held.
+ * The file is only used when it was saved from the same memory, by the same version of the translator.
+ */
+static void load_cache(RecompilerCache* cache) {
+    char path[4096];
+    if (!directory || !cache_path(cache, path, sizeof path))
+        return;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    uint8_t* file = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        file = (uint8_t*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (file == MAP_FAILED)
+        return;
+
+    size_t size = st.st_size;
+    size_t offset = sizeof(CacheFileHeader) + cache->memory_size;
+
+    CacheFileHeader header;
+    memcpy(&header, file, size < sizeof header ? size : sizeof header);
+    bool valid =
+        size >= offset
+        && !memcmp(header.magic, CACHE_FILE_MAGIC, sizeof header.magic)
+        && header.version == TRANSLATE_VERSION
+        && header.layout == CACHE_FILE_LAYOUT
+        && header.variant == (uint32_t) cache->variant
+        && header.memory_size == cache->memory_size
+        && !memcmp(file + sizeof header, cache->memory, cache->memory_size);
+
+    x64_arena_unlock(&cache->arena);
+    for (uint32_t i = 0; valid && i < header.blocks_count && size - offset >= sizeof(CodeCache); ++i) {
+        CodeCache saved;
+        memcpy(&saved, file + offset, sizeof saved);
+        offset += sizeof saved;
+
+        if (!is_loadable(cache, &saved) || cache->caches[saved.start] || size - offset < saved.code.buffer_size)
+            break;
+
+        CodeCache* block = &cache->pool[saved.start];
+        *block = saved;
+        if (x64_arena_begin(&cache->arena, &block->code, CODE_BUFFER_SIZE) != 0)
+            break;
+
+        memcpy(block->code.buffer, file + offset, saved.code.buffer_size);
+        block->code.buffer_ptr = saved.code.buffer_size;
+        offset += saved.code.buffer_size;
+
+        translate_relocate(block);
+        x64_arena_end(&cache->arena, &block->code);
+        add_block(cache, block);
+    }
+
+    munmap(file, size);
+
+    // Chain blocks once all of them are there.
+    for (uint32_t pc = 0; pc < 4096; ++pc) {
+        CodeCache* block = cache->caches[pc];
+        for (uint8_t i = 0; block && i < block->links_count; ++i)
+            if (translatable(block->links[i].target) && cache->caches[block->links[i].target])
+                link_blocks(block, cache->caches[block->links[i].target]);
+    }
+
+    cache->unsaved = false;
+}
+
+void recompiler_set_directory(const char* path) {
+    pthread_mutex_lock(&registry_mutex);
+    free(directory);
+    directory = NULL;
+
+    if (path) {
+        directory = (char*) malloc(strlen(path) + 1);
+        strcpy(directory, path);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void recompiler_set_perf_map(bool enabled) {
+    pthread_mutex_lock(&perf_map_mutex);
+    if (perf_map)
+        fclose(perf_map);
+    perf_map = NULL;
+
+    if (enabled) {
+        char path[64];
+        snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) getpid());
+        perf_map = fopen(path, "w");
+        if (!perf_map)
+            perror("fopen");
+        else
+            setvbuf(perf_map, NULL, _IOLBF, 0);
+    }
+    pthread_mutex_unlock(&perf_map_mutex);
+}
+
+void recompiler_release(RecompilerState* repository) {
+    if (repository->worker)
+        worker_stop(repository->worker);
+
+    RecompilerCache* cache = repository->cache;
+    if (cache && --cache->references == 0) {
+        drop_code();
+        save_cache(cache);
+        unregister_cache(cache);
+        x64_arena_release(&cache->arena);
+        free(cache->pool);
+        free(cache);
+    }
+
+    recompiler_init(repository);
+}
+
+/**
+ * Whether a block of a shared cache was translated from the same code as in the memory of the machine.
+ */
+static bool matches(RecompilerCache* cache, Chip8* state, CodeCache* block) {
+    return same_code(block, state->memory, cache->memory);
+}
+
+/**
+ * Use the shared cache of the ROM which is loaded, or create it.
+ */
+static void attach(RecompilerState* repository, Chip8* state) {
+    uint32_t mem_size = state->variant == VARIANT_XO_CHIP ? 65536 : 4096;
+
+    // Held while loading, so that other threads do not create a second cache of the same ROM meanwhile.
+    pthread_mutex_lock(&registry_mutex);
+    for (RecompilerCache* cache = registry; cache; cache = cache->next) {
+        if (cache->variant == state->variant && !memcmp(cache->memory, state->memory, mem_size)) {
+            cache->references++;
+            repository->cache = cache;
+            pthread_mutex_unlock(&registry_mutex);
+            return;
+        }
+    }
+
+    repository->cache = create_cache(state, true);
+    load_cache(repository->cache);
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+/**
+ * Stop sharing blocks with other machines, when memory diverged from the shared one.
+ * The last user keeps the blocks, others start over with an empty cache.
+ */
+static void detach(RecompilerState* repository, Chip8* state) {
+    RecompilerCache* cache = repository->cache;
+    if (!cache->shared)
+        return;
+
+    drop_code();
+
+    if (cache->references == 1) {
+        save_cache(cache);
+
+        // Keep the blocks which were translated from the same code.
+        x64_arena_unlock(&cache->arena);
+        for (uint32_t pc = 0; pc < 4096; ++pc)
+            if (cache->caches[pc] && !matches(cache, state, cache->caches[pc]))
+                remove_block(cache, cache->caches[pc]);
+
+        unregister_cache(cache);
+    }
+    else {
+        cache->references--;
+        repository->cache = create_cache(state, false);
+    }
+
+    repository->generation = repository->cache->generation;
+    repository->checked = repository->cache->added_count;
+}
+
+/**
+ * Check the blocks that other machines added since last step against memory of this one.
+ */
+static bool check_blocks(RecompilerState* repository, Chip8* state) {
+    RecompilerCache* cache = repository->cache;
+    if (repository->generation != cache->generation) {
+        repository->generation = cache->generation;
+        repository->checked = 0;
+    }
+
+    if (!cache->shared)
+        return true;
+
+    for (; repository->checked < cache->added_count; ++repository->checked)
+        if (!matches(cache, state, cache->caches[cache->added[repository->checked]]))
+            return false;
+
+    return true;
+}
+
+/**
+ * Translate the block at PC at the end of the arena, without keeping it yet.
+ */
+static CodeCache* translate(RecompilerCache* repository, Chip8* state, const uint16_t* heat) {
+    CodeCache* cache = &repository->pool[state->PC];
+
+    x64_arena_unlock(&repository->arena);
+    if (x64_arena_begin(&repository->arena, &cache->code, CODE_BUFFER_SIZE) != 0) {
+        flush(repository);
+        x64_arena_begin(&repository->arena, &cache->code, CODE_BUFFER_SIZE);
+    }
+
+    translate_block(cache, state, heat);
+    return cache;
+}
+
+/**
+ * Attach to the blocks of the ROM, and drop the ones which do not match memory anymore.
+ */
+static void refresh(RecompilerState* repository, Chip8* state) {
+    if (!repository->cache)
+        attach(repository, state);
+
+    // Memory diverged from the one blocks translated by other machines come from.
+    if (!check_blocks(repository, state))
+        detach(repository, state);
+
+    // Self-modifying code: translations of overwritten memory are stale.
+    if (state->written_start != state->written_end) {
+        detach(repository, state);
+        x64_arena_unlock(&repository->cache->arena);
+        invalidate_written(repository->cache, state);
+    }
+}
+
+/**
+ * Add a block translated in the background, unless memory changed since it was requested.
+ */
+static void install(RecompilerState* repository, Chip8* state, CodeCache* translated, uint8_t* memory) {
+    uint16_t start = translated->start;
+    if (!same_code(translated, state->memory, memory))
+        return;
+
+    if (repository->cache->shared && !matches(repository->cache, state, translated))
+        detach(repository, state);
+
+    RecompilerCache* repository_cache = repository->cache;
+    if (repository_cache->caches[start])
+        return;
+
+    // Code is position independent: it only needs to be copied in the arena.
+    CodeCache* cache = &repository_cache->pool[start];
+    x64_arena_unlock(&repository_cache->arena);
+    if (x64_arena_begin(&repository_cache->arena, &cache->code, CODE_BUFFER_SIZE) != 0) {
+        flush(repository_cache);
+        x64_arena_begin(&repository_cache->arena, &cache->code, CODE_BUFFER_SIZE);
+    }
+
+    X86fn code = cache->code;
+    *cache = *translated;
+    cache->code = code;
+    memcpy(cache->code.buffer, translated->code.buffer, translated->code.buffer_size);
+    cache->code.buffer_ptr = translated->code.buffer_size;
+
+    x64_arena_end(&repository_cache->arena, &cache->code);
+    add_block(repository_cache, cache);
+    link_block(repository_cache, cache);
+    repository->checked = repository_cache->added_count;
+
+    // Interpreted stores until the block runs must already invalidate it.
+    memcpy(state->code_pages, repository_cache->code_pages, sizeof state->code_pages);
+}
+
+bool recompiler_ready(RecompilerState* repository, Chip8* state) {
+    refresh(repository, state);
+
+    if (repository->worker) {
+        CompileJob* job = worker_collect(repository->worker);
+        while (job) {
+            CompileJob* next = job->next;
+            install(repository, state, &job->block, job->state.memory);
+            worker_free_job(job);
+            job = next;
+        }
+    }
+
+    return translatable(state->PC) && repository->cache->caches[state->PC] != NULL;
+}
+
+void recompiler_submit(RecompilerState* repository, Chip8* state) {
+    if (!translatable(state->PC))
+        return;
+
+    if (!repository->worker)
+        repository->worker = worker_start();
+
+    if (repository->worker)
+        worker_submit(repository->worker, state, repository->heat);
+}
+
 Chip8Error recompiler_step(RecompilerState* repository, Chip8 *state) {
+    refresh(repository, state);
+
+    if (!translatable(state->PC))
+        return CHIP8_OPCODE_NOT_SUPPORTED;
+
     // Compile code of the required section if needed.
-    CodeCache* cache = repository->caches[state->PC];
+    CodeCache* cache = repository->cache->caches[state->PC];
     if (!cache) {
-        cache = (CodeCache*) malloc(sizeof(CodeCache));
-        translate_block(cache, state);
-        repository->caches[state->PC] = cache;
+        cache = translate(repository->cache, state, repository->heat);
+
+        if (repository->cache->shared && !matches(repository->cache, state, cache)) {
+            detach(repository, state);
+            cache = translate(repository->cache, state, repository->heat);
+        }
+
+        x64_arena_end(&repository->cache->arena, &cache->code);
+        add_block(repository->cache, cache);
+        link_block(repository->cache, cache);
+        repository->checked = repository->cache->added_count;
+    }
+
+    // Predicted returns may jump into code which was dropped since last run.
+    uint32_t current = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (repository->dropped != current) {
+        repository->dropped = current;
+        memset(state->return_code, 0, sizeof state->return_code);
     }
 
-    // Run section
-    return (Chip8Error) x64_run(&cache->code);
+    // Run section, it will keep running chained sections until state->cycles_limit.
+    memcpy(state->code_pages, repository->cache->code_pages, sizeof state->code_pages);
+    x64_arena_lock(&repository->cache->arena);
+    return (Chip8Error) x64_run(&repository->cache->arena, cache->code.buffer, state);
 }
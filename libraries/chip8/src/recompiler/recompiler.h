@@ -1,13 +1,78 @@
 #pragma once
 #include "translate.h"
+#include "worker.h"
 #include "../chip8.h"
 
-typedef struct {
+/** Size of the executable memory shared by all blocks */
+#define CODE_ARENA_SIZE (8 * 1024 * 1024)
+
+/**
+ * Translated blocks, shared by all virtual machines running the same ROM on the same variant.
+ *
+ * Blocks take the chip8 state as an argument, so they can run on any machine whose memory
+ * matches the one they were translated from. Machines which diverge from the shared memory
+ * (self-modifying code, different data) move to a private cache.
+ * Caches are not thread safe: machines using the same ROM must run on the same thread.
+ * Machines running different ROMs can run on different threads, the registry of caches is locked.
+ *
+ * Shared caches can be saved on disk, keyed by a hash of memory, the variant and the translator version.
+ * Calls to C functions are relocated when loading, and links between blocks are patched again.
+ */
+typedef struct RecompilerCache {
+
+    X64Arena arena;
+    CodeCache* pool; // Metadata of blocks, indexed by start address.
 
     CodeCache* caches[4096];
+    uint16_t page_blocks[CHIP8_PAGE_COUNT]; // Number of blocks covering each page of memory.
+    uint8_t code_pages[CHIP8_PAGE_COUNT];   // Copied to the state of machines before running blocks.
+
+    uint16_t added[4096];  // Start of blocks, in translation order.
+    uint32_t added_count;
+    uint32_t generation;   // Incremented when all blocks get flushed.
+    bool unsaved;          // Blocks were added since the cache was loaded from or saved to disk.
+
+    uint32_t references;
+    bool shared;           // Listed in the registry, where machines loading the same ROM find it.
+    Chip8Variant variant;
+    uint8_t* memory;       // Memory blocks were translated from, only for shared caches.
+    uint32_t memory_size;
+    struct RecompilerCache* next;
+
+} RecompilerCache;
+
+typedef struct {
+
+    RecompilerCache* cache; // Attached on first step.
+    uint32_t generation;    // Generation of the cache when blocks were last checked.
+    uint32_t checked;       // Number of added blocks checked against the memory of this machine.
+    CompileWorker* worker;  // Started by the first background translation.
+    uint32_t dropped;       // Count of dropped code when predicted returns were last checked.
+    const uint16_t* heat;   // Times each address was interpreted, when profiled. Traces follow the hot path of skips.
 
 } RecompilerState;
 
 Chip8Error recompiler_init(RecompilerState* repository);
+
+// Run translated code from PC until cycles_limit.
+// Returns CHIP8_OPCODE_NOT_SUPPORTED for code to interpret instead, such as XO-Chip code past the first 4KB.
 Chip8Error recompiler_step(RecompilerState* repository, Chip8 *state);
 
+// Whether code at PC is already translated, so that recompiler_step would not need to translate it.
+// Blocks translated in the background are installed here.
+bool recompiler_ready(RecompilerState* repository, Chip8 *state);
+
+// Translate code at PC in a background thread, recompiler_ready tells when it is installed.
+void recompiler_submit(RecompilerState* repository, Chip8 *state);
+
+// Detach from translated blocks, to be called when the memory of the machine gets replaced.
+// The last machine using blocks of a ROM saves them in the cache directory.
+void recompiler_release(RecompilerState* repository);
+
+// Save and load blocks of ROMs in a directory, so that they are not translated again on next runs.
+// NULL disables the cache directory, which is the default.
+void recompiler_set_directory(const char* path);
+
+// Describe translated blocks in /tmp/perf-<pid>.map, so that perf reports them by CHIP-8 address.
+// Disabled by default.
+void recompiler_set_perf_map(bool enabled);
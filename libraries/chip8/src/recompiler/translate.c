@@ -1,247 +1,766 @@
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "translate.h"
 
+/** Blocks are split once their code gets close to the buffer size */
+#define BLOCK_MAX_SIZE (CODE_BUFFER_SIZE - 512)
 
-/** 
- * Compute length of next instruction in x64.
- * This is needed to compute relative jumps when translating skip instructions
+/**
+ * Host registers with a fixed role in translated code.
+ * EAX, ECX and EDX are free to be used as scratch registers.
  */
-static int next_length(CodeCache* cache, Chip8* state) {
-    cache->end += 2;
+#define STATE EBX   // Pointer to the Chip8 state
+#define CYCLES EBP  // state->cycles_since_started
+#define REG_I R12   // state->I, zero-extended so that it can index memory
+
+#define V(x) (offsetof(Chip8, registers) + (x))
+#define COUNTOF(array) (sizeof(array) / sizeof((array)[0]))
+
+/** Host registers which can hold guest registers for the duration of a block */
+static const X86reg allocatable[] = { ESI, EDI, R8, R9, R10, R11, R13, R14, R15 };
+
+/** Callee-saved registers (System V ABI) which are used in translated code */
+static const X86reg saved[] = { EBX, EBP, R12, R13, R14, R15 };
+
+/** C functions called by translated code, relocations refer to them by index */
+static void (*const functions[])(void) = {
+    (void (*)(void)) chip8_clear_display,
+    (void (*)(void)) rand,
+    (void (*)(void)) chip8_draw_sprite,
+    (void (*)(void)) chip8_pressed_key,
+    (void (*)(void)) chip8_scroll_display,
+    (void (*)(void)) chip8_draw_large_sprite,
+};
 
-    int buffer_ptr = cache->code.buffer_ptr; // Save pointer
-    translate_instruction(cache, state); // Write instruction
 
-    int length = cache->code.buffer_ptr - buffer_ptr; // compute length
+/////////
+// Register allocation
+/////////
 
-    // Restore cache.
-    cache->code.buffer_ptr = buffer_ptr;
-    cache->end -= 2;
-    return length;
+static bool is_allocated(CodeCache* cache, uint8_t x) {
+    return (cache->allocated >> x) & 1;
+}
+
+/**
+ * Count guest registers used by an instruction.
+ * Only instructions translated without leaving the block matter.
+ */
+static void count_uses(Chip8Opcode* opcode, uint32_t uses[16]) {
+    switch (opcode->id) {
+        case OPCODE_SE_VX_VY:
+        case OPCODE_SNE_VX_VY:
+        case OPCODE_LD_VX_VY:
+        case OPCODE_OR_VX_VY:
+        case OPCODE_AND_VX_VY:
+        case OPCODE_XOR_VX_VY:
+            uses[opcode->y]++;
+            // fallthrough
+
+        case OPCODE_SE_VX_KK:
+        case OPCODE_SNE_VX_KK:
+        case OPCODE_LD_VX_KK:
+        case OPCODE_ADD_VX_KK:
+        case OPCODE_LD_VX_DT:
+        case OPCODE_LD_DT_VX:
+        case OPCODE_LD_ST_VX:
+        case OPCODE_ADD_I_VX:
+            uses[opcode->x]++;
+            break;
+
+        case OPCODE_ADD_VX_VY:
+        case OPCODE_SUB_VX_VY:
+        case OPCODE_SUBN_VX_VY:
+            uses[opcode->y]++;
+            // fallthrough
+
+        case OPCODE_SHR_VX_VY:
+        case OPCODE_SHL_VX_VY:
+            uses[opcode->x]++;
+            uses[15]++;
+            break;
+
+        case OPCODE_LD_I_VX:
+        case OPCODE_LD_VX_I:
+            for (uint8_t i = 0; i <= opcode->x; ++i)
+                uses[i]++;
+            break;
+
+        case OPCODE_JP_V0_NNN:
+            uses[0]++;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Choose which guest registers are kept in host registers for the whole block.
+ *
+ * The most used registers of the upcoming instructions are picked. This only needs to be a good guess:
+ * registers which are not allocated are simply read from and written to the Chip8 state.
+ */
+static void allocate_registers(CodeCache* cache) {
+    uint32_t uses[16] = {0};
+
+    for (uint32_t i = 0; i < cache->ir->count; ++i) {
+        IrInstruction* instruction = &cache->ir->instructions[i];
+        if (!instruction->skipped && !instruction->dead)
+            count_uses(&instruction->opcode, uses);
+    }
+
+    cache->allocated = 0;
+    for (size_t i = 0; i < COUNTOF(allocatable); ++i) {
+        int best = -1;
+        for (uint8_t x = 0; x < 16; ++x)
+            if (!is_allocated(cache, x) && uses[x] && (best == -1 || uses[x] > uses[best]))
+                best = x;
+
+        if (best == -1)
+            break;
+
+        cache->allocated |= 1 << best;
+        cache->registers[best] = allocatable[i];
+    }
+}
+
+/** reg <- Vx (low byte of reg) */
+static void load_vx(CodeCache* cache, X86reg reg, uint8_t x) {
+    if (!is_allocated(cache, x))
+        x64_mov_regmem8(&cache->code, reg, STATE, V(x));
+    else if (cache->registers[x] != reg)
+        x64_mov_regreg8(&cache->code, reg, cache->registers[x]);
+}
+
+/** reg <- Vx, zero extended to 32 bits */
+static void load_vx_zx(CodeCache* cache, X86reg reg, uint8_t x) {
+    if (is_allocated(cache, x))
+        x64_movzx_regreg8(&cache->code, reg, cache->registers[x]);
+    else
+        x64_movzx_regmem8(&cache->code, reg, STATE, V(x));
+}
+
+/** Vx <- reg (low byte of reg) */
+static void store_vx(CodeCache* cache, uint8_t x, X86reg reg) {
+    if (!is_allocated(cache, x))
+        x64_mov_memreg8(&cache->code, STATE, V(x), reg);
+    else if (cache->registers[x] != reg)
+        x64_mov_regreg8(&cache->code, cache->registers[x], reg);
+
+    cache->dirty |= 1 << x;
+}
+
+/** Vx <- kk */
+static void store_vx_imm(CodeCache* cache, uint8_t x, uint8_t kk) {
+    if (is_allocated(cache, x))
+        x64_mov_regimm8(&cache->code, cache->registers[x], kk);
+    else
+        x64_mov_memimm8(&cache->code, STATE, V(x), kk);
+
+    cache->dirty |= 1 << x;
+}
+
+/** Vx <- Vx op Vy, host flags are set by the operation. */
+static void encode_alu_vx_vy(CodeCache* cache, X64Alu op, uint8_t x, uint8_t y) {
+    if (is_allocated(cache, x) && is_allocated(cache, y))
+        x64_alu_regreg8(&cache->code, op, cache->registers[x], cache->registers[y]);
+    else if (is_allocated(cache, x))
+        x64_alu_regmem8(&cache->code, op, cache->registers[x], STATE, V(y));
+    else {
+        load_vx(cache, EAX, y);
+        x64_alu_memreg8(&cache->code, op, STATE, V(x), is_allocated(cache, y) ? cache->registers[y] : EAX);
+    }
+
+    if (op != X64_CMP)
+        cache->dirty |= 1 << x;
+}
+
+/** Vx <- Vx op kk, host flags are set by the operation. */
+static void encode_alu_vx_kk(CodeCache* cache, X64Alu op, uint8_t x, uint8_t kk) {
+    if (is_allocated(cache, x))
+        x64_alu_regimm8(&cache->code, op, cache->registers[x], kk);
+    else
+        x64_alu_memimm8(&cache->code, op, STATE, V(x), kk);
+
+    if (op != X64_CMP)
+        cache->dirty |= 1 << x;
+}
+
+/** rdx <- state->memory, so that [rdx + REG_I + n] is memory[I + n] */
+static void load_memory(CodeCache* cache) {
+    x64_mov_regmem64(&cache->code, EDX, STATE, offsetof(Chip8, memory));
+}
+
+/** VF <- host flag, unless VF is overwritten before anything reads it */
+static void encode_set_vf(CodeCache* cache, X64Cond cond) {
+    if (!((cache->live >> 15) & 1))
+        return;
+
+    if (is_allocated(cache, 15))
+        x64_setcc_reg8(&cache->code, cond, cache->registers[15]);
+    else
+        x64_setcc_mem8(&cache->code, cond, STATE, V(15));
+
+    cache->dirty |= 1 << 15;
+}
+
+/////////
+// Block entry & exits
+/////////
+
+/** Load the guest registers which live in host registers during the block. */
+static void encode_entry(CodeCache* cache) {
+    for (uint8_t x = 0; x < 16; ++x)
+        if (is_allocated(cache, x))
+            x64_movzx_regmem8(&cache->code, cache->registers[x], STATE, V(x));
+
+    x64_movzx_regmem16(&cache->code, REG_I, STATE, offsetof(Chip8, I));
+    x64_mov_regmem32(&cache->code, CYCLES, STATE, offsetof(Chip8, cycles_since_started));
+}
+
+/** Update PC, and add elapsed cycles */
+static void encode_pc(CodeCache* cache, uint16_t pc, uint32_t cycles) {
+    x64_mov_regimm32(&cache->code, EAX, pc);
+    x64_mov_memreg16(&cache->code, STATE, offsetof(Chip8, PC), EAX);
+
+    if (cycles)
+        x64_add_regimm32(&cache->code, CYCLES, cycles);
+}
+
+/** Write back guest registers modified so far, and elapsed cycles. */
+static void encode_writeback(CodeCache* cache) {
+    for (uint8_t x = 0; x < 16; ++x)
+        if (is_allocated(cache, x) && (cache->dirty >> x) & 1)
+            x64_mov_memreg8(&cache->code, STATE, V(x), cache->registers[x]);
+
+    if (cache->dirty_i)
+        x64_mov_memreg16(&cache->code, STATE, offsetof(Chip8, I), REG_I);
+
+    x64_mov_memreg32(&cache->code, STATE, offsetof(Chip8, cycles_since_started), CYCLES);
+}
+
+/** Restore callee-saved registers and return code to the caller. */
+static void encode_return(CodeCache* cache, Chip8Error code) {
+    x64_mov_regimm32(&cache->code, EAX, code);
+    x64_epilogue(&cache->code, saved, COUNTOF(saved));
 }
 
 /**
  * Encode x64 for errors (invalid/unsupported opcode).
- * 
+ *
  * This simply make the generated function update the state (PC & elapsed cycles)
  * and return the error to the caller.
  */
 static bool encode_error(CodeCache* cache, Chip8Error code) {
-    if (cache->start < cache->end) {
-        // Update program counter.
-        x64_mov_regimm32(&cache->code, EAX, cache->end);
-        x64_mov_memreg16(&cache->code, ECX, offsetof(Chip8, PC), EAX);
-
-        // Update elapsed cycles
-        x64_mov_regimm32(&cache->code, EAX, (cache->end - cache->start) / 2);
-        x64_add_memreg32(&cache->code, ECX, offsetof(Chip8, cycles_since_started), EAX);
-    }
+    if (cache->count)
+        encode_pc(cache, cache->end, cache->count);
 
-    // return error code.
-    x64_mov_regimm32(&cache->code, EAX, code);
-    x64_retn(&cache->code);
+    encode_writeback(cache);
+    encode_return(cache, code);
+    return true;
+}
+
+/** Whether a host register is clobbered by calls (System V ABI) */
+static bool is_caller_saved(X86reg reg) {
+    for (size_t i = 0; i < COUNTOF(saved); ++i)
+        if (saved[i] == reg)
+            return false;
 
     return true;
 }
 
+/**
+ * Encode x64 to call a C function, arguments must be loaded by the caller.
+ *
+ * The function can access the Chip8 state: guest registers must be written back before,
+ * and the ones it modifies must be given in order to be reloaded after.
+ */
+static void encode_call(CodeCache* cache, void (*function)(void), uint16_t modified) {
+    x64_mov_regimm64(&cache->code, EAX, (uint64_t) (uintptr_t) function);
+
+    // Address is the immediate which ends the mov.
+    CodeCall* call = &cache->calls[cache->calls_count++];
+    call->offset = cache->code.buffer_ptr - 8;
+    for (call->function = 0; functions[call->function] != function; ++call->function)
+        ;
+
+    x64_call_reg(&cache->code, EAX);
+
+    for (uint8_t x = 0; x < 16; ++x)
+        if (is_allocated(cache, x) && (is_caller_saved(cache->registers[x]) || (modified >> x) & 1))
+            x64_movzx_regmem8(&cache->code, cache->registers[x], STATE, V(x));
+}
+
+/**
+ * Continue the block at another address, instead of leaving it.
+ * cache->end is moved so that it reaches target once incremented past the current instruction.
+ */
+static void encode_follow(CodeCache* cache, uint16_t target) {
+    cache->ranges[cache->ranges_count - 1].end = cache->end + 2;
+    cache->ranges[cache->ranges_count++].start = target;
+    cache->end = target - 2;
+}
+
+/**
+ * Encode x64 to leave the block towards an address known at translation time.
+ *
+ * PC and elapsed cycles must be up to date. As long as the cycle limit is not reached,
+ * the link slot will jump directly into the translated target, once it exists.
+ */
+static void encode_link(CodeCache* cache, uint16_t target) {
+    encode_writeback(cache);
+
+    // Go back to the dispatcher when cycles_since_started >= cycles_limit
+    X64Label limit;
+    x64_label_init(&limit);
+    x64_cmp_regmem32(&cache->code, CYCLES, STATE, offsetof(Chip8, cycles_limit));
+    x64_jcc_label(&cache->code, X64_NC, &limit);
+
+    // Chain with target.
+    uint32_t slot = x64_link_slot(&cache->code);
+    if (cache->links_count < CODE_LINKS_MAX) {
+        CodeLink* link = &cache->links[cache->links_count++];
+        link->target = target;
+        link->slot = slot;
+        link->linked = false;
+    }
+
+    x64_label_bind(&cache->code, &limit);
+    encode_return(cache, CHIP8_OK);
+}
+
+/**
+ * Encode x64 to push the return address of a CALL on the shadow stack, next to the one of the guest.
+ * ax must hold the address of the CALL, and rdx the stack pointer.
+ * The continuation label must be bound by encode_continuation.
+ */
+static void encode_push_return(CodeCache* cache, X64Label* continuation) {
+    x64_mov_idxreg16(&cache->code, STATE, EDX, X64_SCALE_2, offsetof(Chip8, return_calls), EAX);
+
+    // state->return_code[sp] = continuation
+    x64_lea_label(&cache->code, EAX, continuation);
+    x64_mov_idxreg64(&cache->code, STATE, EDX, X64_SCALE_8, offsetof(Chip8, return_code), EAX);
+}
+
+/**
+ * Encode x64 for the continuation of a CALL, which predicted returns jump into.
+ *
+ * It is outside of the flow of the block: registers and PC were written back by the RET,
+ * and the cycle limit was checked. It chains with the block after the CALL once it exists.
+ */
+static void encode_continuation(CodeCache* cache, X64Label* continuation) {
+    x64_label_bind(&cache->code, continuation);
+
+    uint32_t slot = x64_link_slot(&cache->code);
+    CodeLink* link = &cache->links[cache->links_count++];
+    link->target = cache->end + 2;
+    link->slot = slot;
+    link->linked = false;
+
+    encode_return(cache, CHIP8_OK);
+}
+
+/**
+ * Encode x64 to jump into the continuation of the CALL a RET returns to, when it was predicted.
+ *
+ * The shadow stack is only trusted when it holds the same address as the guest stack,
+ * which the interpreter may have changed. Registers, PC and cycles must be written back,
+ * and rdx must hold the stack pointer, once decremented.
+ */
+static void encode_predicted_return(CodeCache* cache) {
+    X64Label missed;
+    x64_label_init(&missed);
+
+    x64_cmp_regmem32(&cache->code, CYCLES, STATE, offsetof(Chip8, cycles_limit));
+    x64_jcc_label(&cache->code, X64_NC, &missed);
+
+    x64_movzx_regidx16(&cache->code, EAX, STATE, EDX, X64_SCALE_2, offsetof(Chip8, stack));
+    x64_movzx_regidx16(&cache->code, ECX, STATE, EDX, X64_SCALE_2, offsetof(Chip8, return_calls));
+    x64_alu_regreg32(&cache->code, X64_CMP, EAX, ECX);
+    x64_jcc_label(&cache->code, X64_NZ, &missed);
+
+    x64_mov_regidx64(&cache->code, EAX, STATE, EDX, X64_SCALE_8, offsetof(Chip8, return_code));
+    x64_alu_regimm64(&cache->code, X64_CMP, EAX, 0);
+    x64_jcc_label(&cache->code, X64_Z, &missed);
+    x64_jmp_reg(&cache->code, EAX);
+
+    x64_label_bind(&cache->code, &missed);
+}
+
+/**
+ * Encode x64 to jump back to the start of the block, until the cycle limit is reached.
+ *
+ * Guest registers stay in host registers from one iteration to the next. They are still
+ * written back, as exits which come before in the block only know about earlier writes.
+ */
+static void encode_loop(CodeCache* cache) {
+    x64_add_regimm32(&cache->code, CYCLES, 1 + cache->count);
+    encode_writeback(cache);
+
+    // Loop while cycles_since_started < cycles_limit
+    x64_cmp_regmem32(&cache->code, CYCLES, STATE, offsetof(Chip8, cycles_limit));
+
+    x64_jcc_label(&cache->code, X64_C, &cache->body);
+
+    encode_pc(cache, cache->start, 0);
+    encode_return(cache, CHIP8_OK);
+}
+
+/**
+ * Encode x64 to leave the block after skipping the cycles of an idle loop.
+ *
+ * The iterations which would run before the cycle limit are all the same: instead of running them,
+ * cycles_since_started is incremented as many times as it would be by iterations of length instructions.
+ * PC and elapsed cycles of the current iteration must be up to date.
+ */
+static void encode_idle(CodeCache* cache, uint32_t length) {
+    X64Label reached;
+    x64_label_init(&reached);
+    x64_cmp_regmem32(&cache->code, CYCLES, STATE, offsetof(Chip8, cycles_limit));
+    x64_jcc_label(&cache->code, X64_NC, &reached);
+
+    // cycles += (cycles_limit - cycles + length - 1) / length * length
+    x64_mov_regmem32(&cache->code, EAX, STATE, offsetof(Chip8, cycles_limit));
+    x64_alu_regreg32(&cache->code, X64_SUB, EAX, CYCLES);
+    x64_add_regimm32(&cache->code, EAX, length - 1);
+    x64_alu_regreg32(&cache->code, X64_XOR, EDX, EDX);
+    x64_mov_regimm32(&cache->code, ECX, length);
+    x64_div_reg32(&cache->code, ECX);
+    x64_imul_regregimm32(&cache->code, EAX, EAX, length);
+    x64_alu_regreg32(&cache->code, X64_ADD, CYCLES, EAX);
+
+    x64_label_bind(&cache->code, &reached);
+    encode_writeback(cache);
+    encode_return(cache, CHIP8_OK);
+}
+
+/**
+ * Encode x64 to skip the next instruction, host flags must be set by the caller.
+ *
+ * Elapsed cycles must have been decremented before setting the flags: they are
+ * incremented back only when the next instruction is executed.
+ */
+static void encode_skip(CodeCache* cache, X64Cond cond) {
+    // Trace: the block goes on with the next instruction, skipping it leaves the block.
+    if (cache->follow) {
+        X64Label taken;
+        x64_label_init(&taken);
+        x64_jcc_label(&cache->code, (X64Cond) (cond ^ 1), &taken);
+        encode_pc(cache, cache->target, 2 + cache->count); // cycles were decremented
+        encode_link(cache, cache->target);
+        x64_label_bind(&cache->code, &taken);
+
+        x64_inc_reg32(&cache->code, CYCLES);
+        return;
+    }
+
+    // Bound by translate_instruction once the next instruction is written.
+    x64_jcc_label(&cache->code, cond, &cache->skipped);
+
+    x64_inc_reg32(&cache->code, CYCLES);
+}
+
+/**
+ * Encode x64 to check a write of length bytes at I, and then to increment I.
+ *
+ * When the written pages hold translated code, the block is left right away,
+ * so that the recompiler can invalidate it before anything stale gets executed.
+ */
+static void encode_written(CodeCache* cache, uint8_t length, uint8_t increment) {
+    // edx = I, eax = first written page, ecx = last written page
+    x64_movzx_regreg16(&cache->code, EDX, REG_I);
+    x64_mov_regreg32(&cache->code, EAX, EDX);
+    x64_shr_regimm32(&cache->code, EAX, CHIP8_PAGE_SHIFT);
+    x64_mov_regreg32(&cache->code, ECX, EDX);
+    x64_add_regimm32(&cache->code, ECX, length - 1);
+    x64_shr_regimm32(&cache->code, ECX, CHIP8_PAGE_SHIFT);
+    x64_alu_regimm32(&cache->code, X64_AND, ECX, CHIP8_PAGE_COUNT - 1);
+
+    if (increment) {
+        x64_add_regimm16(&cache->code, REG_I, increment);
+        cache->dirty_i = true;
+    }
+
+    // al = state->code_pages[eax] | state->code_pages[ecx]
+    x64_add_regreg64(&cache->code, EAX, STATE);
+    x64_add_regreg64(&cache->code, ECX, STATE);
+    x64_movzx_regmem8(&cache->code, EAX, EAX, offsetof(Chip8, code_pages));
+    x64_alu_regmem8(&cache->code, X64_OR, EAX, ECX, offsetof(Chip8, code_pages));
+
+    X64Label clean;
+    x64_label_init(&clean);
+    x64_jcc_label(&cache->code, X64_Z, &clean);
+
+    // Nothing else was written since the recompiler last checked: no need to merge ranges.
+    x64_mov_memreg32(&cache->code, STATE, offsetof(Chip8, written_start), EDX);
+    x64_add_regimm32(&cache->code, EDX, length);
+    x64_mov_memreg32(&cache->code, STATE, offsetof(Chip8, written_end), EDX);
+
+    encode_pc(cache, cache->end + 2, 1 + cache->count);
+    encode_writeback(cache);
+    encode_return(cache, CHIP8_OK);
+
+    x64_label_bind(&cache->code, &clean);
+}
+
+/////////
+// Instructions
+/////////
+
 static bool encode_invalid(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) opcode, (void) state;
     return encode_error(cache, CHIP8_OPCODE_INVALID);
 }
 
-static bool encode_not_supported(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+static bool encode_cls(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) opcode, (void) state;
-    return encode_error(cache, CHIP8_OPCODE_NOT_SUPPORTED);
+
+    // chip8_clear_display(state)
+    encode_writeback(cache);
+    x64_mov_regreg64(&cache->code, EDI, STATE);
+    encode_call(cache, (void (*)(void)) chip8_clear_display, 0);
+    return false;
 }
 
 static bool encode_ret(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) opcode, (void) state;
 
-    // state->SP--
-    x64_dec_mem8(&cache->code, ECX, offsetof(Chip8, SP));
+    // Return of an inlined subroutine: the stack is not empty, and the return address is known.
+    if (cache->follow) {
+        x64_dec_mem8(&cache->code, STATE, offsetof(Chip8, SP));
+        encode_follow(cache, cache->target);
+        return false;
+    }
+
+    // Leave with an error when state->SP == 0
+    X64Label valid;
+    x64_label_init(&valid);
+    x64_alu_memimm8(&cache->code, X64_CMP, STATE, offsetof(Chip8, SP), 0);
+    x64_jcc_label(&cache->code, X64_NZ, &valid);
+    encode_error(cache, CHIP8_CALL_STACK_EMPTY);
+    x64_label_bind(&cache->code, &valid);
 
-    // Compute pointer &state + SP*2
-    x64_movzx_regmem8(&cache->code, EDX, ECX, offsetof(Chip8, SP)); // sp dans rdx
-    x64_add_regreg64(&cache->code, EDX, EDX); // multiplie par 2
-    x64_add_regreg64(&cache->code, EDX, ECX); // &state dans rdx
+    // state->SP--
+    x64_dec_mem8(&cache->code, STATE, offsetof(Chip8, SP));
 
     // Update PC and cycles
-    x64_mov_regmem16(&cache->code, EAX, EDX, offsetof(Chip8, stack)); // ax = [state + stack + 2*sp]
+    x64_movzx_regmem8(&cache->code, EDX, STATE, offsetof(Chip8, SP)); // rdx = sp
+    x64_movzx_regidx16(&cache->code, EAX, STATE, EDX, X64_SCALE_2, offsetof(Chip8, stack)); // ax = stack[sp]
     x64_add_aximm8(&cache->code, 2); // ax += 2
-    x64_mov_memreg16(&cache->code, ECX, offsetof(Chip8, PC), EAX);
-
-    x64_mov_regimm32(&cache->code, EAX, 1 + (cache->end - cache->start) / 2);
-    x64_add_memreg32(&cache->code, ECX, offsetof(Chip8, cycles_since_started), EAX);
+    x64_mov_memreg16(&cache->code, STATE, offsetof(Chip8, PC), EAX);
+    x64_add_regimm32(&cache->code, CYCLES, 1 + cache->count);
 
-    // return CHIP8_OK
-    x64_mov_regimm32(&cache->code, EAX, CHIP8_OK);
-    x64_retn(&cache->code);
+    encode_writeback(cache);
+    encode_predicted_return(cache);
+    encode_return(cache, CHIP8_OK);
     return true;
 }
 
 static bool encode_jmp_nnn(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
-    (void) state;
+    if (cache->follow) {
+        encode_follow(cache, opcode->nnn);
+        return false;
+    }
 
-    // Update PC and cycles
-    x64_mov_regimm32(&cache->code, EAX, opcode->nnn);
-    x64_mov_memreg16(&cache->code, ECX, offsetof(Chip8, PC), EAX);
-    x64_mov_regimm32(&cache->code, EAX, 1 + (cache->end - cache->start) / 2);
-    x64_add_memreg32(&cache->code, ECX, offsetof(Chip8, cycles_since_started), EAX);
-
-    // return CHIP8_OK
-    x64_mov_regimm32(&cache->code, EAX, CHIP8_OK);
-    x64_retn(&cache->code);
+    // Tight loops run natively, without leaving the block.
+    // Idle loops are only looked for in contiguous code.
+    if (opcode->nnn == cache->start) {
+        uint32_t length = cache->ranges_count == 1 ? chip8_idle_loop(state, cache->start, cache->end) : 0;
+
+        if (length) {
+            encode_pc(cache, cache->start, 1 + cache->count);
+            encode_idle(cache, length);
+        }
+        else
+            encode_loop(cache);
+
+        return true;
+    }
+
+    encode_pc(cache, opcode->nnn, 1 + cache->count);
+    encode_link(cache, opcode->nnn);
     return true;
 }
 
 static bool encode_call_nnn(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
 
-    // Compute pointer &state + SP*2
-    x64_movzx_regmem8(&cache->code, EDX, ECX, offsetof(Chip8, SP)); // rdx = sp
-    x64_add_regreg64(&cache->code, EDX, EDX); // rdx *= 2
-    x64_add_regreg64(&cache->code, EDX, ECX); // rdx += &state
+    // Leave with an error when state->SP == 16
+    X64Label valid;
+    x64_label_init(&valid);
+    x64_alu_memimm8(&cache->code, X64_CMP, STATE, offsetof(Chip8, SP), 16);
+    x64_jcc_label(&cache->code, X64_C, &valid);
+    encode_error(cache, CHIP8_CALL_STACK_FULL);
+    x64_label_bind(&cache->code, &valid);
 
-    // Save PC
+    // Save PC: stack[sp] = pc
+    x64_movzx_regmem8(&cache->code, EDX, STATE, offsetof(Chip8, SP)); // rdx = sp
     x64_mov_regimm32(&cache->code, EAX, cache->end);
-    x64_mov_memreg16(&cache->code, EDX, offsetof(Chip8, stack), EAX); // &state + offsetof(Chip8, stack) + 2*sp = pc
+    x64_mov_idxreg16(&cache->code, STATE, EDX, X64_SCALE_2, offsetof(Chip8, stack), EAX);
+
+    // Small subroutines are inlined: the stack is still updated for the exits they contain.
+    if (cache->follow) {
+        x64_inc_mem8(&cache->code, STATE, offsetof(Chip8, SP));
+        encode_follow(cache, opcode->nnn);
+        return false;
+    }
+
+    // Predict the return, unless links are missing to chain the continuation.
+    X64Label continuation;
+    bool predicted = cache->links_count + 2 <= CODE_LINKS_MAX;
+    x64_label_init(&continuation);
+    if (predicted)
+        encode_push_return(cache, &continuation);
 
     // state->sp++
-    x64_inc_mem8(&cache->code, ECX, offsetof(Chip8, SP));
+    x64_inc_mem8(&cache->code, STATE, offsetof(Chip8, SP));
+
+    encode_pc(cache, opcode->nnn, 1 + cache->count);
+    encode_link(cache, opcode->nnn);
+
+    if (predicted)
+        encode_continuation(cache, &continuation);
 
-    // Update PC and cycles
-    x64_mov_regimm32(&cache->code, EAX, opcode->nnn);
-    x64_mov_memreg16(&cache->code, ECX, offsetof(Chip8, PC), EAX);
-    x64_mov_regimm32(&cache->code, EAX, 1 + (cache->end - cache->start) / 2);
-    x64_add_memreg32(&cache->code, ECX, offsetof(Chip8, cycles_since_started), EAX);
-
-    // return CHIP8_OK
-    x64_mov_regimm32(&cache->code, EAX, CHIP8_OK);
-    x64_retn(&cache->code);
     return true;
 }
 
 static bool encode_se_vx_kk(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
-    x64_dec_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles--
-    x64_mov_regimm32(&cache->code, EAX, opcode->kk); // load kk in register
-    x64_cmp_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x); // cmp Vx, kk
-    x64_jz8(&cache->code, 3 + next_length(cache, state)); // jz after next instruction (inc is 3bytes)
-    x64_inc_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles++
+    (void) state;
+    x64_dec_reg32(&cache->code, CYCLES); // cycles--
+    encode_alu_vx_kk(cache, X64_CMP, opcode->x, opcode->kk); // cmp Vx, kk
+    encode_skip(cache, X64_Z);
     return false;
 }
 
 static bool encode_sne_vx_kk(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
-    x64_dec_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles--
-    x64_mov_regimm32(&cache->code, EAX, opcode->kk); // load kk in register
-    x64_cmp_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x); // cmp Vx, kk
-    x64_jnz8(&cache->code, 3 + next_length(cache, state)); // jz after next instruction (inc is 3bytes)
-    x64_inc_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles++
+    (void) state;
+    x64_dec_reg32(&cache->code, CYCLES); // cycles--
+    encode_alu_vx_kk(cache, X64_CMP, opcode->x, opcode->kk); // cmp Vx, kk
+    encode_skip(cache, X64_NZ);
     return false;
 }
 
 static bool encode_se_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
-    x64_dec_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles--
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y); // mov al, [state->registers + y]
-    x64_cmp_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x); // cmp Vx, kk
-    x64_jz8(&cache->code, 3 + next_length(cache, state)); // jz after next instruction (inc is 3bytes)
-    x64_inc_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles++
+    (void) state;
+    x64_dec_reg32(&cache->code, CYCLES); // cycles--
+    encode_alu_vx_vy(cache, X64_CMP, opcode->x, opcode->y); // cmp Vx, Vy
+    encode_skip(cache, X64_Z);
     return false;
 }
 
 static bool encode_ld_vx_kk(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regimm32(&cache->code, EAX, opcode->kk); // mov eax, kk
-    x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX); // mov [state->registers + x], al
+    store_vx_imm(cache, opcode->x, opcode->kk);
     return false;
 }
 
 static bool encode_add_vx_kk(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regimm32(&cache->code, EAX, opcode->kk); // mov eax, kk
-    x64_add_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX); // add [state->registers + x], al
+    encode_alu_vx_kk(cache, X64_ADD, opcode->x, opcode->kk);
     return false;
 }
 
 static bool encode_ld_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
+
+    if (is_allocated(cache, opcode->x)) {
+        load_vx(cache, cache->registers[opcode->x], opcode->y);
+        cache->dirty |= 1 << opcode->x;
+    }
+    else {
+        load_vx(cache, EAX, opcode->y);
+        store_vx(cache, opcode->x, EAX);
+    }
+
     return false;
 }
 
 static bool encode_or_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_or_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
+    encode_alu_vx_vy(cache, X64_OR, opcode->x, opcode->y);
     return false;
 }
 
 static bool encode_and_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_and_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
+    encode_alu_vx_vy(cache, X64_AND, opcode->x, opcode->y);
     return false;
 }
 
 static bool encode_xor_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_xor_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
+    encode_alu_vx_vy(cache, X64_XOR, opcode->x, opcode->y);
     return false;
 }
 
 static bool encode_add_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_add_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
-    x64_setc(&cache->code, ECX, offsetof(Chip8, registers) + 15);
+    encode_alu_vx_vy(cache, X64_ADD, opcode->x, opcode->y);
+    encode_set_vf(cache, X64_C);
     return false;
 }
 
 static bool encode_sub_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_sub_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
-    x64_setnc(&cache->code, ECX, offsetof(Chip8, registers) + 15); // x > y
+    encode_alu_vx_vy(cache, X64_SUB, opcode->x, opcode->y);
+    encode_set_vf(cache, X64_NC); // x > y
     return false;
 }
 
 static bool encode_shr_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_shr_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x);
-    x64_setc(&cache->code, ECX, offsetof(Chip8, registers) + 15);
+
+    if (is_allocated(cache, opcode->x))
+        x64_shr_reg8(&cache->code, cache->registers[opcode->x]);
+    else
+        x64_shr_memreg8(&cache->code, STATE, V(opcode->x));
+
+    cache->dirty |= 1 << opcode->x;
+    encode_set_vf(cache, X64_C);
     return false;
 }
 
 static bool encode_subn_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y);
-    x64_sub_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x);
-    x64_setnc(&cache->code, ECX, offsetof(Chip8, registers) + 15);
-    x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
+    load_vx(cache, EAX, opcode->y);
+
+    if (is_allocated(cache, opcode->x))
+        x64_alu_regreg8(&cache->code, X64_SUB, EAX, cache->registers[opcode->x]);
+    else
+        x64_alu_regmem8(&cache->code, X64_SUB, EAX, STATE, V(opcode->x));
+
+    encode_set_vf(cache, X64_NC);
+    store_vx(cache, opcode->x, EAX);
     return false;
 }
 
 static bool encode_shl_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_shl_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x);
-    x64_setc(&cache->code, ECX, offsetof(Chip8, registers) + 15);
+
+    if (is_allocated(cache, opcode->x))
+        x64_shl_reg8(&cache->code, cache->registers[opcode->x]);
+    else
+        x64_shl_memreg8(&cache->code, STATE, V(opcode->x));
+
+    cache->dirty |= 1 << opcode->x;
+    encode_set_vf(cache, X64_C);
     return false;
 }
 
 static bool encode_sne_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
-    x64_dec_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles--
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->y); // mov al, [state->registers + y]
-    x64_cmp_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x); // cmp Vx, kk
-    x64_jnz8(&cache->code, 3 + next_length(cache, state)); // jz after next instruction (inc is 3bytes)
-    x64_inc_mem32(&cache->code, ECX, offsetof(Chip8, cycles_since_started)); // cycles++
+    (void) state;
+    x64_dec_reg32(&cache->code, CYCLES); // cycles--
+    encode_alu_vx_vy(cache, X64_CMP, opcode->x, opcode->y); // cmp Vx, Vy
+    encode_skip(cache, X64_NZ);
     return false;
 }
 
 static bool encode_ld_i_nnn(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regimm32(&cache->code, EAX, opcode->nnn);
-    x64_mov_memreg16(&cache->code, ECX, offsetof(Chip8, I), EAX);
+    x64_mov_regimm32(&cache->code, REG_I, opcode->nnn);
+    cache->dirty_i = true;
     return false;
 }
 
@@ -249,90 +768,388 @@ static bool encode_jp_v0_nnn(CodeCache* cache, Chip8* state, Chip8Opcode* opcode
     (void) state;
 
     // Update PC and cycles
-    x64_mov_regimm32(&cache->code, EAX, opcode->nnn);
-    x64_mov_memreg16(&cache->code, ECX, offsetof(Chip8, PC), EAX);
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers)); // not super efficient
-    x64_add_memreg16(&cache->code, ECX, offsetof(Chip8, PC), EAX);
-
-    // Update cycles
-    x64_mov_regimm32(&cache->code, EAX, 1 + (cache->end - cache->start) / 2);
-    x64_add_memreg32(&cache->code, ECX, offsetof(Chip8, cycles_since_started), EAX);
-
-    // return CHIP8_OK
-    x64_mov_regimm32(&cache->code, EAX, CHIP8_OK);
-    x64_retn(&cache->code);
+    load_vx_zx(cache, EAX, 0);
+    x64_add_regimm32(&cache->code, EAX, opcode->nnn);
+    x64_mov_memreg16(&cache->code, STATE, offsetof(Chip8, PC), EAX);
+    x64_add_regimm32(&cache->code, CYCLES, 1 + cache->count);
+
+    encode_writeback(cache);
+    encode_return(cache, CHIP8_OK);
     return true;
 }
 
+static bool encode_rnd_vx_kk(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    // Vx = rand() & kk
+    encode_writeback(cache);
+    encode_call(cache, (void (*)(void)) rand, 0);
+    x64_alu_regimm8(&cache->code, X64_AND, EAX, opcode->kk);
+    store_vx(cache, opcode->x, EAX);
+    return false;
+}
+
+static bool encode_drw_vx_vy_n(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    // Drawing is done in C, which reads I and registers from the state.
+    encode_writeback(cache);
+
+    // chip8_draw_sprite(state, Vx, Vy, n)
+    x64_mov_regreg64(&cache->code, EDI, STATE);
+    x64_movzx_regmem8(&cache->code, ESI, STATE, V(opcode->x));
+    x64_movzx_regmem8(&cache->code, EDX, STATE, V(opcode->y));
+    x64_mov_regimm32(&cache->code, ECX, opcode->n);
+    encode_call(cache, (void (*)(void)) chip8_draw_sprite, 1 << 15);
+    return false;
+}
+
+/** Set host flags to state->keyboard[Vx & 0xF] != 0 */
+static void encode_test_key(CodeCache* cache, uint8_t x) {
+    load_vx_zx(cache, EAX, x);
+    x64_alu_regimm32(&cache->code, X64_AND, EAX, 0xF);
+    x64_add_regreg64(&cache->code, EAX, STATE);
+    x64_alu_memimm8(&cache->code, X64_CMP, EAX, offsetof(Chip8, keyboard), 0);
+}
+
+static bool encode_skp_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    x64_dec_reg32(&cache->code, CYCLES); // cycles--
+    encode_test_key(cache, opcode->x);
+    encode_skip(cache, X64_NZ);
+    return false;
+}
+
+static bool encode_sknp_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    x64_dec_reg32(&cache->code, CYCLES); // cycles--
+    encode_test_key(cache, opcode->x);
+    encode_skip(cache, X64_Z);
+    return false;
+}
+
 static bool encode_ld_vx_dt(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, DT));
-    x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + opcode->x, EAX);
+
+    if (is_allocated(cache, opcode->x)) {
+        x64_mov_regmem8(&cache->code, cache->registers[opcode->x], STATE, offsetof(Chip8, DT));
+        cache->dirty |= 1 << opcode->x;
+    }
+    else {
+        x64_mov_regmem8(&cache->code, EAX, STATE, offsetof(Chip8, DT));
+        store_vx(cache, opcode->x, EAX);
+    }
+
     return false;
 }
 
 static bool encode_ld_vx_k(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
-    (void) opcode, (void) state;
-    return encode_error(cache, CHIP8_OPCODE_NOT_SUPPORTED);
+    (void) state;
+
+    // eax = chip8_pressed_key(state)
+    encode_writeback(cache);
+    x64_mov_regreg64(&cache->code, EDI, STATE);
+    encode_call(cache, (void (*)(void)) chip8_pressed_key, 0);
+
+    // No key is pressed: keys do not change until cycles_limit, wait until then.
+    X64Label pressed;
+    x64_label_init(&pressed);
+    x64_alu_regimm32(&cache->code, X64_CMP, EAX, 0);
+    x64_jcc_label(&cache->code, X64_NS, &pressed);
+    encode_pc(cache, cache->end, 1 + cache->count);
+    encode_idle(cache, 1);
+    x64_label_bind(&cache->code, &pressed);
+
+    store_vx(cache, opcode->x, EAX);
+    return false;
 }
 
 static bool encode_ld_dt_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x);
-    x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, DT), EAX);
+    load_vx(cache, EAX, opcode->x);
+    x64_mov_memreg8(&cache->code, STATE, offsetof(Chip8, DT), EAX);
     return false;
 }
 
 static bool encode_ld_st_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x);
-    x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, ST), EAX);
+    load_vx(cache, EAX, opcode->x);
+    x64_mov_memreg8(&cache->code, STATE, offsetof(Chip8, ST), EAX);
     return false;
 }
 
 static bool encode_add_i_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
-    x64_movzx_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + opcode->x);
-    x64_add_memreg16(&cache->code, ECX, offsetof(Chip8, I), EAX);
+    load_vx_zx(cache, EAX, opcode->x);
+    x64_add_regreg16(&cache->code, REG_I, EAX);
+    cache->dirty_i = true;
+    return false;
+}
+
+static bool encode_ld_f_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    load_vx_zx(cache, EAX, opcode->x);
+    x64_imul_regregimm32(&cache->code, REG_I, EAX, 5);
+    cache->dirty_i = true;
+    return false;
+}
+
+static bool encode_ld_b_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    load_memory(cache); // rdx = state->memory
+
+    // Divisions by 10 are multiplications by 205 / 2048, which are exact below 1029.
+    // memory[I + 2] = Vx - 10 * (Vx / 10)
+    load_vx_zx(cache, EAX, opcode->x);
+    x64_imul_regregimm32(&cache->code, ECX, EAX, 205);
+    x64_shr_regimm32(&cache->code, ECX, 11);
+    x64_imul_regregimm32(&cache->code, ECX, ECX, 10);
+    x64_alu_regreg32(&cache->code, X64_SUB, EAX, ECX);
+    x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, 2, EAX);
+
+    // eax = Vx / 10, memory[I] = eax / 10, memory[I + 1] = eax - 10 * (eax / 10)
+    load_vx_zx(cache, EAX, opcode->x);
+    x64_imul_regregimm32(&cache->code, EAX, EAX, 205);
+    x64_shr_regimm32(&cache->code, EAX, 11);
+    x64_imul_regregimm32(&cache->code, ECX, EAX, 205);
+    x64_shr_regimm32(&cache->code, ECX, 11);
+    x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, 0, ECX);
+    x64_imul_regregimm32(&cache->code, ECX, ECX, 10);
+    x64_alu_regreg32(&cache->code, X64_SUB, EAX, ECX);
+    x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, 1, EAX);
+
+    encode_written(cache, 3, 0);
     return false;
 }
 
 static bool encode_ld_i_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
 
-    x64_movzx_regmem16(&cache->code, EDX, ECX, offsetof(Chip8, I));
-    x64_add_regreg64(&cache->code, EDX, ECX);
+    load_memory(cache); // rdx = state->memory
 
     for (uint8_t reg_id = 0; reg_id <= opcode->x; ++reg_id) {
-        x64_mov_regmem8(&cache->code, EAX, ECX, offsetof(Chip8, registers) + reg_id);
-        x64_mov_memreg8(&cache->code, EDX, offsetof(Chip8, memory) + reg_id, EAX);
+        if (is_allocated(cache, reg_id))
+            x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, reg_id, cache->registers[reg_id]);
+        else {
+            x64_mov_regmem8(&cache->code, EAX, STATE, V(reg_id));
+            x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, reg_id, EAX);
+        }
     }
 
-    x64_mov_regimm32(&cache->code, EAX, opcode->x + 1);
-    x64_add_memreg16(&cache->code, ECX, offsetof(Chip8, I), EAX);
+    encode_written(cache, opcode->x + 1, opcode->x + 1);
     return false;
 }
 
 static bool encode_ld_vx_i(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
     (void) state;
 
-    x64_movzx_regmem16(&cache->code, EDX, ECX, offsetof(Chip8, I));
-    x64_add_regreg64(&cache->code, EDX, ECX);
+    load_memory(cache); // rdx = state->memory
+
+    for (uint8_t reg_id = 0; reg_id <= opcode->x; ++reg_id) {
+        if (is_allocated(cache, reg_id)) {
+            x64_mov_regidx8(&cache->code, cache->registers[reg_id], EDX, REG_I, X64_SCALE_1, reg_id);
+            cache->dirty |= 1 << reg_id;
+        }
+        else {
+            x64_mov_regidx8(&cache->code, EAX, EDX, REG_I, X64_SCALE_1, reg_id);
+            store_vx(cache, reg_id, EAX);
+        }
+    }
+
+    x64_add_regimm16(&cache->code, REG_I, opcode->x + 1);
+    cache->dirty_i = true;
+    return false;
+}
+
+static bool encode_scroll(CodeCache* cache, int32_t dx, int32_t dy) {
+    // chip8_scroll_display(state, dx, dy)
+    encode_writeback(cache);
+    x64_mov_regreg64(&cache->code, EDI, STATE);
+    x64_mov_regimm32(&cache->code, ESI, dx);
+    x64_mov_regimm32(&cache->code, EDX, dy);
+    encode_call(cache, (void (*)(void)) chip8_scroll_display, 0);
+    return false;
+}
+
+static bool encode_scrl_down_n(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    return encode_scroll(cache, 0, opcode->n);
+}
+
+static bool encode_scrl_left(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode, (void) state;
+    return encode_scroll(cache, -4, 0);
+}
+
+static bool encode_scrl_right(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode, (void) state;
+    return encode_scroll(cache, 4, 0);
+}
+
+static bool encode_exit(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode, (void) state;
+
+    // Like errors, exiting does not count as a cycle.
+    encode_pc(cache, cache->end + 2, cache->count);
+    encode_writeback(cache);
+    encode_return(cache, CHIP8_EXIT);
+    return true;
+}
+
+static bool encode_hidef(CodeCache* cache, uint32_t width, uint32_t height) {
+    x64_mov_memimm32(&cache->code, STATE, offsetof(Chip8, display_width), width);
+    x64_mov_memimm32(&cache->code, STATE, offsetof(Chip8, display_height), height);
+    return false;
+}
+
+static bool encode_hidef_off(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode, (void) state;
+    return encode_hidef(cache, 64, 32);
+}
+
+static bool encode_hidef_on(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode, (void) state;
+    return encode_hidef(cache, 128, 64);
+}
+
+static bool encode_drw_vx_vy_0(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    // chip8_draw_large_sprite(state, Vx, Vy)
+    encode_writeback(cache);
+    x64_mov_regreg64(&cache->code, EDI, STATE);
+    x64_movzx_regmem8(&cache->code, ESI, STATE, V(opcode->x));
+    x64_movzx_regmem8(&cache->code, EDX, STATE, V(opcode->y));
+    encode_call(cache, (void (*)(void)) chip8_draw_large_sprite, 1 << 15);
+    return false;
+}
+
+static bool encode_ld_i_digit(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    load_vx_zx(cache, EAX, opcode->x);
+    x64_imul_regregimm32(&cache->code, REG_I, EAX, 10);
+    x64_add_regimm32(&cache->code, REG_I, CHIP8_LARGE_FONT);
+    cache->dirty_i = true;
+    return false;
+}
+
+static bool encode_ld_rpl_vx(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    for (uint8_t reg_id = 0; reg_id <= opcode->x; ++reg_id) {
+        load_vx(cache, EAX, reg_id);
+        x64_mov_memreg8(&cache->code, STATE, offsetof(Chip8, rpl) + reg_id,
+            is_allocated(cache, reg_id) ? cache->registers[reg_id] : EAX);
+    }
+
+    return false;
+}
+
+static bool encode_ld_vx_rpl(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
 
     for (uint8_t reg_id = 0; reg_id <= opcode->x; ++reg_id) {
-        x64_mov_regmem8(&cache->code, EAX, EDX, offsetof(Chip8, memory) + reg_id);
-        x64_mov_memreg8(&cache->code, ECX, offsetof(Chip8, registers) + reg_id, EAX);
+        if (is_allocated(cache, reg_id)) {
+            x64_mov_regmem8(&cache->code, cache->registers[reg_id], STATE, offsetof(Chip8, rpl) + reg_id);
+            cache->dirty |= 1 << reg_id;
+        }
+        else {
+            x64_mov_regmem8(&cache->code, EAX, STATE, offsetof(Chip8, rpl) + reg_id);
+            store_vx(cache, reg_id, EAX);
+        }
+    }
+
+    return false;
+}
+
+static bool encode_ld_i_vx_vy(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    int step = opcode->x <= opcode->y ? 1 : -1;
+    int length = step * (opcode->y - opcode->x) + 1;
+
+    load_memory(cache); // rdx = state->memory
+
+    for (int i = 0; i < length; ++i) {
+        uint8_t reg_id = opcode->x + step * i;
+
+        if (is_allocated(cache, reg_id))
+            x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, i, cache->registers[reg_id]);
+        else {
+            x64_mov_regmem8(&cache->code, EAX, STATE, V(reg_id));
+            x64_mov_idxreg8(&cache->code, EDX, REG_I, X64_SCALE_1, i, EAX);
+        }
+    }
+
+    encode_written(cache, length, 0);
+    return false;
+}
+
+static bool encode_ld_vx_vy_i(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+
+    int step = opcode->x <= opcode->y ? 1 : -1;
+    int length = step * (opcode->y - opcode->x) + 1;
+
+    load_memory(cache); // rdx = state->memory
+
+    for (int i = 0; i < length; ++i) {
+        uint8_t reg_id = opcode->x + step * i;
+
+        if (is_allocated(cache, reg_id)) {
+            x64_mov_regidx8(&cache->code, cache->registers[reg_id], EDX, REG_I, X64_SCALE_1, i);
+            cache->dirty |= 1 << reg_id;
+        }
+        else {
+            x64_mov_regidx8(&cache->code, EAX, EDX, REG_I, X64_SCALE_1, i);
+            store_vx(cache, reg_id, EAX);
+        }
     }
 
-    x64_mov_regimm32(&cache->code, EAX, opcode->x + 1);
-    x64_add_memreg16(&cache->code, ECX, offsetof(Chip8, I), EAX);
     return false;
 }
 
+static bool encode_ld_i_nnnn(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode;
+
+    // The operand follows the instruction, translate_instruction moves past it.
+    uint16_t operand = cache->end + 2;
+    uint16_t nnnn = state->memory[operand] << 8 | state->memory[(uint16_t) (operand + 1)];
+
+    x64_mov_regimm32(&cache->code, REG_I, nnnn);
+    cache->dirty_i = true;
+    return false;
+}
+
+static bool encode_drw_pln_n(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    x64_mov_memimm8(&cache->code, STATE, offsetof(Chip8, display_mask), opcode->x);
+    return false;
+}
+
+static bool encode_ld_audio_i(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) opcode, (void) state;
+
+    load_memory(cache); // rdx = state->memory
+
+    for (int32_t i = 0; i < (int32_t) sizeof state->audio; i += 8) {
+        x64_mov_regidx64(&cache->code, EAX, EDX, REG_I, X64_SCALE_1, i);
+        x64_mov_memreg64(&cache->code, STATE, offsetof(Chip8, audio) + i, EAX);
+    }
+
+    return false;
+}
+
+static bool encode_scrl_up_n(CodeCache* cache, Chip8* state, Chip8Opcode* opcode) {
+    (void) state;
+    return encode_scroll(cache, 0, -opcode->n);
+}
+
 static bool (*encode_instruction[])(CodeCache*, Chip8*, Chip8Opcode*) = {
     // Original
     encode_invalid,       // OPCODE_INVALID
-    encode_not_supported, // OPCODE_CLS,
+    encode_cls,           // OPCODE_CLS,
     encode_ret,           // OPCODE_RET,
     encode_jmp_nnn,       // OPCODE_JMP_NNN,
     encode_call_nnn,      // OPCODE_CALL_NNN,
@@ -353,79 +1170,182 @@ static bool (*encode_instruction[])(CodeCache*, Chip8*, Chip8Opcode*) = {
     encode_sne_vx_vy,     // OPCODE_SNE_VX_VY,
     encode_ld_i_nnn,      // OPCODE_LD_I_NNN,
     encode_jp_v0_nnn,     // OPCODE_JP_V0_NNN,
-    encode_not_supported, // OPCODE_RND_VX_KK,
-    encode_not_supported, // OPCODE_DRW_VX_VY_N,
-    encode_not_supported, // OPCODE_SKP_VX,
-    encode_not_supported, // OPCODE_SKNP_VX,
+    encode_rnd_vx_kk,     // OPCODE_RND_VX_KK,
+    encode_drw_vx_vy_n,   // OPCODE_DRW_VX_VY_N,
+    encode_skp_vx,        // OPCODE_SKP_VX,
+    encode_sknp_vx,       // OPCODE_SKNP_VX,
     encode_ld_vx_dt,      // OPCODE_LD_VX_DT,
     encode_ld_vx_k,       // OPCODE_LD_VX_K,
     encode_ld_dt_vx,      // OPCODE_LD_DT_VX,
     encode_ld_st_vx,      // OPCODE_LD_ST_VX,
     encode_add_i_vx,      // OPCODE_ADD_I_VX,
-    encode_not_supported, // OPCODE_LD_F_VX,
-    encode_not_supported, // OPCODE_LD_B_VX,
-    encode_not_supported, // OPCODE_LD_I_VX,
-    encode_not_supported, // OPCODE_LD_VX_I,
+    encode_ld_f_vx,       // OPCODE_LD_F_VX,
+    encode_ld_b_vx,       // OPCODE_LD_B_VX,
+    encode_ld_i_vx,       // OPCODE_LD_I_VX,
+    encode_ld_vx_i,       // OPCODE_LD_VX_I,
 
     // S-Chip
-    encode_not_supported, // OPCODE_SCRL_DOWN_N,
-    encode_not_supported, // OPCODE_SCRL_LEFT,
-    encode_not_supported, // OPCODE_SCRL_RIGHT,
-    encode_not_supported, // OPCODE_EXIT,
-    encode_not_supported, // OPCODE_HIDEF_OFF,
-    encode_not_supported, // OPCODE_HIDEF_ON,
-    encode_not_supported, // OPCODE_DRW_VX_VY_0
-    encode_not_supported, // OPCODE_LD_I_AUDIO,
-    encode_not_supported, // OPCODE_LD_RPL_VX,
-    encode_not_supported, // OPCODE_LD_VX_RPL,
+    encode_scrl_down_n,   // OPCODE_SCRL_DOWN_N,
+    encode_scrl_left,     // OPCODE_SCRL_LEFT,
+    encode_scrl_right,    // OPCODE_SCRL_RIGHT,
+    encode_exit,          // OPCODE_EXIT,
+    encode_hidef_off,     // OPCODE_HIDEF_OFF,
+    encode_hidef_on,      // OPCODE_HIDEF_ON,
+    encode_drw_vx_vy_0,   // OPCODE_DRW_VX_VY_0
+    encode_ld_i_digit,    // OPCODE_LD_I_DIGIT,
+    encode_ld_rpl_vx,     // OPCODE_LD_RPL_VX,
+    encode_ld_vx_rpl,     // OPCODE_LD_VX_RPL,
 
     // XO-Chip
-    encode_not_supported, // OPCODE_LD_I_VX_VY,
-    encode_not_supported, // OPCODE_LD_VX_VY_I,
-    encode_not_supported, // OPCODE_LD_I_NNNN,
-    encode_not_supported, // OPCODE_DRW_PLN_N,
-    encode_not_supported, // OPCODE_LD_AUDIO_I,
-    encode_not_supported, // OPCODE_SCRL_UP_N,
+    encode_ld_i_vx_vy,    // OPCODE_LD_I_VX_VY,
+    encode_ld_vx_vy_i,    // OPCODE_LD_VX_VY_I,
+    encode_ld_i_nnnn,     // OPCODE_LD_I_NNNN,
+    encode_drw_pln_n,     // OPCODE_DRW_PLN_N,
+    encode_ld_audio_i,    // OPCODE_LD_AUDIO_I,
+    encode_scrl_up_n,     // OPCODE_SCRL_UP_N,
 };
 
+/**
+ * Ends a block which grew too big, and link it with the next instruction.
+ */
+static void encode_fallthrough(CodeCache* cache) {
+    encode_pc(cache, cache->end, cache->count);
+    encode_link(cache, cache->end);
+}
 
-void translate_block(CodeCache* cache, Chip8* state) {
-    cache->start = cache->end = state->PC;
+/**
+ * Encode an instruction, using what the optimization passes found about it.
+ */
+static bool encode_optimized(CodeCache* cache, Chip8* state, IrInstruction* instruction) {
+    // Never runs, or nothing reads what it computes.
+    if (instruction->skipped || instruction->dead)
+        return false;
+
+    // Skip decided at translation time, the cycle of the skipped instruction is all that's left.
+    if (instruction->skip == IR_SKIP_ALWAYS) {
+        x64_dec_reg32(&cache->code, CYCLES);
+        return false;
+    }
+
+    if (instruction->skip == IR_SKIP_NEVER)
+        return false;
+
+    // Registers computed from constants.
+    if (instruction->folded) {
+        for (uint8_t x = 0; x < 16; ++x)
+            if ((instruction->writes >> x) & 1)
+                store_vx_imm(cache, x, instruction->result.values[x]);
 
-    x64_init(&cache->code, 4096);
-    x64_mov_regimm64(&cache->code, ECX, (uint64_t) state); // Load pointer to chip8 state
+        if (instruction->writes & IR_I) {
+            x64_mov_regimm32(&cache->code, REG_I, instruction->result.i);
+            cache->dirty_i = true;
+        }
+
+        return false;
+    }
+
+    return encode_instruction[instruction->opcode.id](cache, state, &instruction->opcode);
+}
+
+/**
+ * Translate the block, with optimizations looking at its first length instructions at most.
+ * @returns the number of instructions of the block when it had to be split, 0 otherwise.
+ */
+static uint32_t translate_ir(CodeCache* cache, Chip8* state, uint32_t length, const uint16_t* heat) {
+    ir_build(cache->ir, state, state->PC, length, heat);
+
+    cache->code.buffer_ptr = 0;
+    cache->start = cache->end = state->PC;
+    cache->ranges_count = 1;
+    cache->ranges[0].start = state->PC;
+    cache->count = 0;
+    cache->index = 0;
+    cache->after_skip = false;
+    x64_label_init(&cache->skipped);
+    x64_label_init(&cache->body);
+    cache->links_count = 0;
+    cache->calls_count = 0;
+    cache->dirty = 0;
+    cache->dirty_i = false;
+    allocate_registers(cache);
+
+    // Save callee-saved registers, and keep pointer to chip8 state, which is the first argument.
+    // All blocks share the same prologue, so that they can jump into each other.
+    // Code does not depend on the state, so it can run on any machine with the same memory.
+    x64_prologue(&cache->code, saved, COUNTOF(saved));
+    x64_mov_regreg64(&cache->code, STATE, EDI);
+
+    // Chained blocks jump to the entry, make it start a fetch block.
+    x64_align(&cache->code, X64_ALIGN);
+
+    cache->entry = cache->code.buffer_ptr;
+    encode_entry(cache);
+    x64_label_bind(&cache->code, &cache->body);
 
     while (!translate_instruction(cache, state)) {
         cache->end += 2;
+        cache->count++;
+        cache->index++;
+
+        // Split blocks close to the size of buffers. Instruction just after a skip cannot be the end of a block.
+        bool full = cache->code.buffer_ptr > BLOCK_MAX_SIZE || cache->calls_count > CODE_CALLS_MAX - 2;
+        if (full && !cache->after_skip) {
+            encode_fallthrough(cache);
+            cache->ranges[cache->ranges_count - 1].end = cache->end + 2;
+            return cache->count;
+        }
     }
 
-    x64_lock(&cache->code);
+    cache->ranges[cache->ranges_count - 1].end = cache->end + 2;
+    return 0;
+}
 
-    // debug print
-    for (uint32_t i = 0; i < cache->code.buffer_ptr; ++i)
-        printf("%02hhX", cache->code.buffer[i]);
-    printf("   %d\n", (cache->end - cache->start) / 2);
+void translate_block(CodeCache* cache, Chip8* state, const uint16_t* heat) {
+    IrBlock ir;
+    cache->ir = &ir;
+
+    // Dead stores are found assuming that the block runs until the last analyzed instruction.
+    // When it is split before, it is translated again without looking past the split.
+    uint32_t length = IR_INSTRUCTIONS_MAX;
+    uint32_t split;
+    while ((split = translate_ir(cache, state, length, heat)) && split < ir.count)
+        length = split;
+
+    cache->ir = NULL;
 }
 
+void translate_relocate(CodeCache* cache) {
+    for (uint8_t i = 0; i < cache->calls_count; ++i) {
+        uint64_t address = (uint64_t) (uintptr_t) functions[cache->calls[i].function];
+        memcpy(cache->code.buffer + cache->calls[i].offset, &address, sizeof address);
+    }
+}
 
 bool translate_instruction(CodeCache* cache, Chip8* state) {
     // Decode current
     Chip8Opcode opcode;
     chip8_decode(state, &opcode, cache->end);
-    
-    bool done = encode_instruction[opcode.id](cache, state, &opcode);
 
-    // Instruction just after a skip cannot be the end of a block.
-    if (done && cache->end >= 2 && cache->start < cache->end) {
-        chip8_decode(state, &opcode, cache->end - 2);
-
-        done = opcode.id != OPCODE_SE_VX_KK
-            && opcode.id != OPCODE_SNE_VX_KK
-            && opcode.id != OPCODE_SE_VX_VY
-            && opcode.id != OPCODE_SNE_VX_VY
-            && opcode.id != OPCODE_SKP_VX
-            && opcode.id != OPCODE_SKNP_VX;
-    }
+    bool after_skip = cache->after_skip;
+    X64Label skipped = cache->skipped;
+    x64_label_init(&cache->skipped);
+    IrInstruction* instruction = cache->ir && cache->index < cache->ir->count ? &cache->ir->instructions[cache->index] : NULL;
+    cache->live = instruction ? instruction->live : IR_ALL;
+    cache->follow = instruction && instruction->followed;
+    cache->target = instruction ? instruction->target : 0;
+    bool done = instruction
+        ? encode_optimized(cache, state, instruction)
+        : encode_instruction[opcode.id](cache, state, &opcode);
+
+    // The operand of F000 NNNN belongs to the block, even when optimizations left the instruction out.
+    if (opcode.id == OPCODE_LD_I_NNNN)
+        cache->end += 2;
 
-    return done;
+    // Skipping lands after this instruction, which may be a skip itself.
+    if (after_skip)
+        x64_label_bind(&cache->code, &skipped);
+
+    // Instruction just after a skip cannot be the end of a block.
+    cache->after_skip = ir_is_skip(&opcode);
+    return done && !after_skip;
 }
@@ -1,19 +1,94 @@
 #pragma once
+#include "ir.h"
 #include "x64.h"
 #include "../chip8.h"
 
+#define CODE_LINKS_MAX 8
+#define CODE_CALLS_MAX 32
+#define CODE_RANGES_MAX (IR_FOLLOW_MAX + 1)
+
+/** Version of generated code, to be incremented when translations change */
+#define TRANSLATE_VERSION 8
+
+/** Space reserved in the code arena while translating a block */
+#define CODE_BUFFER_SIZE 4096
+
+/**
+ * Exit of a block towards a chip8 address which is known at translation time.
+ * The slot returns to the dispatcher until the target gets translated, it is then
+ * patched to jump straight into it.
+ */
+typedef struct {
+    uint16_t target;
+    uint32_t slot;
+    bool linked;
+} CodeLink;
+
+/**
+ * Call from a block to a C function.
+ * The absolute address of the function must be patched when code is loaded in another process.
+ */
+typedef struct {
+    uint16_t offset;  // Offset of the address in the code.
+    uint8_t function; // Index of the function.
+} CodeCall;
+
+/**
+ * Memory a block was translated from.
+ * Blocks continue through jumps and calls, each address they continue at starts a new range.
+ */
+typedef struct {
+    uint16_t start;
+    uint32_t end;
+} CodeRange;
+
 typedef struct {
     X86fn code;
     uint16_t start;
-    uint16_t end;
+    uint16_t end;   // Address of the current instruction.
+    uint16_t count; // Number of instructions translated so far.
+
+    uint32_t entry; // Offset of the first instruction, where chained blocks jump.
+    uint8_t links_count;
+    CodeLink links[CODE_LINKS_MAX];
+    uint8_t calls_count;
+    CodeCall calls[CODE_CALLS_MAX];
+    uint8_t ranges_count;
+    CodeRange ranges[CODE_RANGES_MAX];
+
+    // Register allocation and optimizations, only meaningful during translation.
+    IrBlock* ir;
+    uint32_t index;         // Position of the current instruction in the IR.
+    uint32_t live;          // Registers read after the current instruction.
+    bool follow;            // Current instruction continues the block at target, see IrInstruction.
+    uint16_t target;
+    uint16_t allocated;     // Guest registers living in host registers.
+    X86reg registers[16];   // Host register of each allocated guest register.
+    uint16_t dirty;         // Guest registers written so far, which exits write back.
+    bool dirty_i;
+    bool after_skip;        // Previous instruction was a skip.
+    X64Label skipped;       // Lands past the instruction which follows a skip.
+    X64Label body;          // First instruction once registers are loaded, where loops jump.
 } CodeCache;
 
-void translate_block(CodeCache* cache, Chip8* state);
+/**
+ * Translate the block starting at PC.
+ * cache->code must have been allocated with at least CODE_BUFFER_SIZE bytes.
+ * heat counts how many times each address was interpreted, to follow the hot path of skips. It can be NULL.
+ */
+void translate_block(CodeCache* cache, Chip8* state, const uint16_t* heat);
+
+/**
+ * Patch the addresses of the C functions called by a block, once its code was copied from a file.
+ */
+void translate_relocate(CodeCache* cache);
 
 /**
  * Reads the instruction which is at cache->end in the Chip8 memory and translate it in x64 code.
- * This function assumes that a pointer to the Chip8 state was previously loaded in the ECX register.
- * Note: cache->end is NOT incremented
+ * This function assumes that a pointer to the Chip8 state was previously loaded in the EBX register,
+ * and that allocated guest registers were loaded in their host registers.
+ * Note: cache->end is NOT incremented, except past the operand of F000 NNNN,
+ * and it is moved before the target of jumps, calls and returns the block continues through.
  * 
  * @returns true when the block is finished, false otherwise
  */
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include "worker.h"
+
+static bool is_requested(CompileWorker* worker, uint16_t pc) {
+    return (worker->requested[pc >> 3] >> (pc & 7)) & 1;
+}
+
+static void set_requested(CompileWorker* worker, uint16_t pc, bool requested) {
+    if (requested)
+        worker->requested[pc >> 3] |= 1 << (pc & 7);
+    else
+        worker->requested[pc >> 3] &= ~(1 << (pc & 7));
+}
+
+static void* run(void* argument) {
+    CompileWorker* worker = (CompileWorker*) argument;
+
+    pthread_mutex_lock(&worker->mutex);
+    while (!worker->stop) {
+        CompileJob* job = worker->pending;
+        if (!job) {
+            pthread_cond_wait(&worker->wake, &worker->mutex);
+            continue;
+        }
+
+        worker->pending = job->next;
+        pthread_mutex_unlock(&worker->mutex);
+
+        translate_block(&job->block, &job->state, job->heat);
+        job->block.code.buffer_size = job->block.code.buffer_ptr;
+
+        pthread_mutex_lock(&worker->mutex);
+        job->next = worker->done;
+        worker->done = job;
+        atomic_fetch_add_explicit(&worker->done_count, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return NULL;
+}
+
+CompileWorker* worker_start(void) {
+    CompileWorker* worker = (CompileWorker*) calloc(1, sizeof(CompileWorker));
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+    atomic_init(&worker->done_count, 0);
+
+    if (pthread_create(&worker->thread, NULL, run, worker) != 0) {
+        pthread_cond_destroy(&worker->wake);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+void worker_free_job(CompileJob* job) {
+    free(job->state.memory);
+    free(job->heat);
+    free(job->block.code.buffer);
+    free(job);
+}
+
+static void free_jobs(CompileJob* job) {
+    while (job) {
+        CompileJob* next = job->next;
+        worker_free_job(job);
+        job = next;
+    }
+}
+
+void worker_stop(CompileWorker* worker) {
+    pthread_mutex_lock(&worker->mutex);
+    worker->stop = true;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_join(worker->thread, NULL);
+
+    free_jobs(worker->pending);
+    free_jobs(worker->done);
+    pthread_cond_destroy(&worker->wake);
+    pthread_mutex_destroy(&worker->mutex);
+    free(worker);
+}
+
+void worker_submit(CompileWorker* worker, Chip8* state, const uint16_t* heat) {
+    // Only the emulation thread sets and clears requests.
+    if (is_requested(worker, state->PC))
+        return;
+
+    uint32_t mem_size = state->variant == VARIANT_XO_CHIP ? 65536 : 4096;
+    CompileJob* job = (CompileJob*) calloc(1, sizeof(CompileJob));
+    job->state = *state;
+    job->state.memory = (uint8_t*) malloc(mem_size);
+    job->state.display = NULL;
+    job->state.decoded = NULL;
+    memcpy(job->state.memory, state->memory, mem_size);
+
+    if (heat) {
+        job->heat = (uint16_t*) malloc(mem_size * sizeof(uint16_t));
+        memcpy(job->heat, heat, mem_size * sizeof(uint16_t));
+    }
+
+    job->block.code.buffer = (uint8_t*) malloc(CODE_BUFFER_SIZE);
+    job->block.code.buffer_size = CODE_BUFFER_SIZE;
+    set_requested(worker, state->PC, true);
+
+    pthread_mutex_lock(&worker->mutex);
+    job->next = worker->pending;
+    worker->pending = job;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+CompileJob* worker_collect(CompileWorker* worker) {
+    if (atomic_load_explicit(&worker->done_count, memory_order_acquire) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&worker->mutex);
+    CompileJob* done = worker->done;
+    worker->done = NULL;
+    atomic_store_explicit(&worker->done_count, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&worker->mutex);
+
+    for (CompileJob* job = done; job; job = job->next)
+        set_requested(worker, job->block.start, false);
+
+    return done;
+}
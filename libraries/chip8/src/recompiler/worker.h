@@ -0,0 +1,44 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include "translate.h"
+
+/**
+ * Block translated in the background.
+ * The worker reads a copy of the machine, and writes code in a heap buffer:
+ * the emulation thread copies it in the arena once it is finished.
+ */
+typedef struct CompileJob {
+    Chip8 state;     // Copy of the machine when the block was requested, with its own memory.
+    uint16_t* heat;  // Copy of the profile of the machine, NULL when it is not profiled.
+    CodeCache block;
+    struct CompileJob* next;
+} CompileJob;
+
+/**
+ * Thread translating the blocks requested by one machine.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool stop;
+
+    CompileJob* pending;        // Waiting for the worker, most recent first.
+    CompileJob* done;           // Waiting to be installed.
+    atomic_uint done_count;     // Read without the mutex, to check for finished blocks cheaply.
+    uint8_t requested[65536 / 8]; // Addresses which are pending or done.
+} CompileWorker;
+
+CompileWorker* worker_start(void);
+
+// Stop the thread and drop unfinished blocks.
+void worker_stop(CompileWorker* worker);
+
+// Request a translation of the block at PC, unless it was already requested.
+void worker_submit(CompileWorker* worker, Chip8* state, const uint16_t* heat);
+
+// Take the finished blocks, they must be released with worker_free_job.
+CompileJob* worker_collect(CompileWorker* worker);
+
+void worker_free_job(CompileJob* job);
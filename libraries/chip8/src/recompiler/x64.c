@@ -1,5 +1,7 @@
 #include <sys/mman.h>
+#include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include "x64.h"
 
 /////////
@@ -43,15 +45,19 @@ static void push_modrm(X86fn* func, uint8_t mod, uint8_t rm, X86reg reg)
 	push_byte(func, byte);
 }
 
-// /**
-//  * @see https://datacadamia.com/lang/assembly/intel/modrm
-//  * @see https://wiki.osdev.org/X86-64_Instruction_Encoding#SIB
-//  */
-// static void push_sibsb(X86fn* func, uint8_t sib, uint8_t rm, uint8_t index)
-// {
-//     uint8_t byte = (sib << 6) | (rm << 4) | index;
-// 	   push_byte(func, byte);
-// }
+/**
+ * The SIB byte follows a ModR/M byte with rm == b100, to address [base + index * scale].
+ *
+ * Scale is 2 bits, index and base are 3 bits. Index b100 (rsp) means that there is none.
+ *
+ * @see https://wiki.osdev.org/X86-64_Instruction_Encoding#SIB
+ */
+static void push_sib(X86fn* func, X64Scale scale, X86reg index, X86reg base) {
+    push_byte(func, (scale << 6) | ((index & 0x7) << 3) | (base & 0x7));
+}
+
+/** Index of memory operands which have none: rsp cannot be an index, SIB encodes the absence of index with it */
+#define NO_INDEX ESP
 
 
 static void push_rex(X86fn* func, bool w, bool r, bool x, bool b) {
@@ -59,79 +65,122 @@ static void push_rex(X86fn* func, bool w, bool r, bool x, bool b) {
     push_byte(func, byte);
 }
 
-
-static void push_opmemreg(X86fn* func, uint8_t opcode, X86reg reg, X86reg ptr, int32_t displacement) {
-    // rex prefix only needed if we use R8...15 registers
-    bool rex_b = ptr >> 3;
+/**
+ * Append a REX prefix, only when needed.
+ *
+ * It is needed for 64 bits operands, to use R8...R15 registers,
+ * and to use SPL, BPL, SIL and DIL as 8 bits operands (without it, 4...7 encode AH, CH, DH and BH).
+ */
+static void push_rex_opt(X86fn* func, bool w, X86reg reg, X86reg index, X86reg rm, bool byte_regs) {
     bool rex_r = reg >> 3;
-    if (rex_b || rex_r) {
-        push_rex(func, 0, rex_r, 0, rex_b);
-    }
+    bool rex_x = index >> 3;
+    bool rex_b = rm >> 3;
 
-    // instruction
-    push_byte(func, opcode);
-    
-    // modrm + displacement
-    reg = (X86reg) (reg & 0x7);
-    ptr = (X86reg) (ptr & 0x7);
-    if (displacement == 0) {
-        push_modrm(func, 0, ptr, reg);
-    }
-    else if (displacement < 256) { // compiler seems to consider the limit is 127
-        push_modrm(func, 1, ptr, reg);
+    if (w || rex_r || rex_x || rex_b || byte_regs)
+        push_rex(func, w, rex_r, rex_x, rex_b);
+}
+
+/** 8 bits registers which need a REX prefix */
+static bool is_byte_rex(X86reg reg) {
+    return reg >= 4 && reg < 8;
+}
+
+/**
+ * Append legacy prefix, REX prefix and opcode of an instruction.
+ *
+ * @param size operand size in bits (16 bits operands need the 0x66 prefix, 64 bits the REX.W bit)
+ * @param opcode one byte opcode, or two bytes opcode escaped with 0x0F (ie: 0x0FB6)
+ */
+static void push_opcode(X86fn* func, uint8_t size, uint16_t opcode, X86reg reg, X86reg index, X86reg rm, bool byte_regs) {
+    if (size == 16)
+        push_byte(func, 0x66); // Operand-Size prefix
+
+    push_rex_opt(func, size == 64, reg, index, rm, byte_regs);
+
+    if (opcode > 0xFF)
+        push_byte(func, opcode >> 8);
+    push_byte(func, opcode & 0xFF);
+}
+
+/**
+ * Append ModR/M byte, SIB byte when needed and displacement, to address [ptr + index * scale + displacement].
+ *
+ * Two encodings of rm are escapes: b100 (rsp and r12) means that a SIB byte follows,
+ * and b101 (rbp and r13) without displacement means [rip + disp32]. Those registers
+ * are still usable as pointers, with a SIB byte and a zero disp8 respectively.
+ */
+static void push_memidx(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement) {
+    uint8_t mod;
+    if (displacement == 0 && (ptr & 0x7) != EBP)
+        mod = 0;
+    else if (displacement >= -128 && displacement < 128) // disp8 is sign-extended
+        mod = 1;
+    else
+        mod = 2;
+
+    bool sib = index != NO_INDEX || (ptr & 0x7) == ESP;
+    push_modrm(func, mod, sib ? ESP : ptr & 0x7, (X86reg) (reg & 0x7));
+    if (sib)
+        push_sib(func, scale, index, ptr);
+
+    if (mod == 1)
         push_byte(func, displacement); // disp8
-    }
-    else {
-        push_modrm(func, 2, ptr, reg);
+    else if (mod == 2)
         push_dword(func, displacement); // disp32
-    }
 }
 
+/** Append ModR/M byte and displacement, to address [ptr + displacement] */
+static void push_mem(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
+    push_memidx(func, reg, ptr, NO_INDEX, X64_SCALE_1, displacement);
+}
 
-static void push_opregreg64(X86fn* func, uint8_t opcode, X86reg reg, X86reg ptr) {
-    // rex prefix only needed if we use R8...15 registers
-    bool rex_b = ptr >> 3;
-    bool rex_r = reg >> 3;
-    push_rex(func, 1, rex_r, 0, rex_b);
+/** Instruction with a register operand and a memory operand */
+static void push_opmemreg(X86fn* func, uint8_t size, uint16_t opcode, X86reg reg, X86reg ptr, int32_t displacement) {
+    push_opcode(func, size, opcode, reg, NO_INDEX, ptr, size == 8 && is_byte_rex(reg));
+    push_mem(func, reg, ptr, displacement);
+}
 
-    // instruction
-    push_byte(func, opcode);
-    
-    // modrm + displacement
-    reg = (X86reg) (reg & 0x7);
-    ptr = (X86reg) (ptr & 0x7);
-    push_modrm(func, 3, ptr, reg);
+/** Instruction with a register operand and an indexed memory operand */
+static void push_opidxreg(X86fn* func, uint8_t size, uint16_t opcode, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement) {
+    push_opcode(func, size, opcode, reg, index, ptr, size == 8 && is_byte_rex(reg));
+    push_memidx(func, reg, ptr, index, scale, displacement);
 }
 
+/** Instruction with a memory operand, where ModR/M reg field is an opcode extension */
+static void push_opmem(X86fn* func, uint8_t size, uint16_t opcode, uint8_t extension, X86reg ptr, int32_t displacement) {
+    push_opcode(func, size, opcode, EAX, NO_INDEX, ptr, false);
+    push_mem(func, (X86reg) extension, ptr, displacement);
+}
 
-static void push_opregreg(X86fn* func, uint8_t opcode, X86reg reg, X86reg ptr) {
-    // rex prefix only needed if we use R8...15 registers
-    bool rex_b = ptr >> 3;
-    bool rex_r = reg >> 3;
-    if (rex_b || rex_r) {
-        push_rex(func, 0, rex_r, 0, rex_b);
-    }
+/** Instruction with two register operands */
+static void push_opregreg(X86fn* func, uint8_t size, uint16_t opcode, X86reg reg, X86reg rm) {
+    push_opcode(func, size, opcode, reg, NO_INDEX, rm, size == 8 && (is_byte_rex(reg) || is_byte_rex(rm)));
+    push_modrm(func, 3, rm & 0x7, (X86reg) (reg & 0x7));
+}
 
-    // instruction
-    push_byte(func, opcode);
-    
-    // modrm + displacement
-    reg = (X86reg) (reg & 0x7);
-    ptr = (X86reg) (ptr & 0x7);
-    push_modrm(func, 3, ptr, reg);
+/** Instruction with a register operand, where ModR/M reg field is an opcode extension */
+static void push_opreg(X86fn* func, uint8_t size, uint16_t opcode, uint8_t extension, X86reg rm) {
+    push_opcode(func, size, opcode, EAX, NO_INDEX, rm, size == 8 && is_byte_rex(rm));
+    push_modrm(func, 3, rm & 0x7, (X86reg) extension);
 }
 
 /////////
-// Init & run
+// Arena
 /////////
 
-int x64_init(X86fn* func, uint32_t size) {
-    func->buffer = (uint8_t*) mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    func->buffer_ptr = 0;
-    func->buffer_size = size;
-    func->executable = false;
+/** Size of the arena which is currently in use, rounded to whole pages */
+static size_t used_pages(X64Arena* arena) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (arena->used + page - 1) / page * page;
+}
+
+int x64_arena_init(X64Arena* arena, uint32_t size) {
+    arena->buffer = (uint8_t*) mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena->size = size;
+    arena->used = 0;
+    arena->executable = false;
 
-    if (func->buffer == MAP_FAILED) {
+    if (arena->buffer == MAP_FAILED) {
         perror("mmap");
         return -1;
     }
@@ -139,28 +188,181 @@ int x64_init(X86fn* func, uint32_t size) {
     return 0;
 }
 
-int x64_lock(X86fn* func) {
-    if (mprotect(func->buffer, func->buffer_size, PROT_READ | PROT_EXEC) == -1) {
+int x64_arena_lock(X64Arena* arena) {
+    if (arena->executable)
+        return 0;
+
+    if (mprotect(arena->buffer, used_pages(arena), PROT_READ | PROT_EXEC) == -1) {
+        perror("mprotect");
+        return -1;
+    }
+
+    arena->executable = true;
+    return 0;
+}
+
+int x64_arena_unlock(X64Arena* arena) {
+    if (!arena->executable)
+        return 0;
+
+    if (mprotect(arena->buffer, used_pages(arena), PROT_READ | PROT_WRITE) == -1) {
         perror("mprotect");
         return -1;
     }
 
-    func->executable = true;
+    arena->executable = false;
     return 0;
 }
 
-int x64_run(X86fn* func) {
-    if (!func->executable) {
+int x64_arena_begin(X64Arena* arena, X86fn* func, uint32_t size) {
+    if (arena->executable || arena->size - arena->used < size)
+        return -1;
+
+    func->buffer = arena->buffer + arena->used;
+    func->buffer_size = size;
+    func->buffer_ptr = 0;
+    return 0;
+}
+
+void x64_arena_end(X64Arena* arena, X86fn* func) {
+    // Next function starts on a new i-cache fetch block.
+    arena->used += (func->buffer_ptr + X64_ALIGN - 1) / X64_ALIGN * X64_ALIGN;
+    func->buffer_size = func->buffer_ptr;
+}
+
+void x64_arena_reset(X64Arena* arena) {
+    x64_arena_unlock(arena);
+    arena->used = 0;
+}
+
+int x64_arena_release(X64Arena* arena) {
+    return munmap(arena->buffer, arena->size);
+}
+
+int x64_run(X64Arena* arena, uint8_t* code, void* argument) {
+    if (!arena->executable) {
         return -1;
     }
 
-    // What about calling conventions?
-    int (*fn)() = (int (*)()) (void*) func->buffer;
-    return fn();
+    // System V calling convention: argument is passed in rdi.
+    int (*fn)(void*) = (int (*)(void*)) (void*) code;
+    return fn(argument);
+}
+
+/////////
+// Links
+/////////
+
+uint32_t x64_link_slot(X86fn* func) {
+    uint32_t slot = func->buffer_ptr;
+
+    // Until patched, the slot is a short jump over itself.
+    x64_jmp8(func, X64_LINK_SLOT_SIZE - 2);
+    for (uint32_t i = 2; i < X64_LINK_SLOT_SIZE; ++i)
+        push_byte(func, 0x90); // nop
+
+    return slot;
+}
+
+void x64_link(X86fn* func, uint32_t slot, uint8_t* target) {
+    uint32_t buffer_ptr = func->buffer_ptr;
+    func->buffer_ptr = slot;
+    x64_mov_regimm64(func, EAX, (uint64_t) target); // mov rax, target
+    x64_jmp_reg(func, EAX);
+    func->buffer_ptr = buffer_ptr;
+}
+
+void x64_unlink(X86fn* func, uint32_t slot) {
+    uint32_t buffer_ptr = func->buffer_ptr;
+    func->buffer_ptr = slot;
+    x64_link_slot(func);
+    func->buffer_ptr = buffer_ptr;
+}
+
+/////////
+// Labels
+/////////
+
+/** Append the displacement which ends an instruction referring to a label. */
+static void push_label(X86fn* func, X64Label* label) {
+    if (label->offset >= 0) {
+        push_dword(func, label->offset - (int32_t) (func->buffer_ptr + 4));
+    }
+    else {
+        int32_t previous = label->pending;
+        label->pending = func->buffer_ptr;
+        push_dword(func, previous);
+    }
+}
+
+void x64_label_init(X64Label* label) {
+    label->offset = -1;
+    label->pending = -1;
+}
+
+void x64_label_bind(X86fn* func, X64Label* label) {
+    label->offset = func->buffer_ptr;
+
+    while (label->pending >= 0) {
+        int32_t ref = label->pending;
+        memcpy(&label->pending, func->buffer + ref, sizeof label->pending);
+
+        int32_t distance = label->offset - (ref + 4);
+        memcpy(func->buffer + ref, &distance, sizeof distance);
+    }
+}
+
+void x64_jcc_label(X86fn* func, X64Cond cond, X64Label* label) {
+    int32_t distance = label->offset - (int32_t) (func->buffer_ptr + 2); // jcc8 is 2 bytes
+    if (label->offset >= 0 && distance >= -128) {
+        x64_jcc8(func, cond, distance);
+        return;
+    }
+
+    push_byte(func, 0x0F);
+    push_byte(func, 0x80 | cond);
+    push_label(func, label);
 }
 
-int x64_release(X86fn* func) {
-    return munmap(func->buffer, func->buffer_size);
+void x64_jmp_label(X86fn* func, X64Label* label) {
+    int32_t distance = label->offset - (int32_t) (func->buffer_ptr + 2); // jmp8 is 2 bytes
+    if (label->offset >= 0 && distance >= -128) {
+        x64_jmp8(func, distance);
+        return;
+    }
+
+    push_byte(func, 0xE9);
+    push_label(func, label);
+}
+
+void x64_lea_label(X86fn* func, X86reg reg, X64Label* label) {
+    push_opcode(func, 64, 0x8D, reg, NO_INDEX, EAX, false);
+    push_modrm(func, 0, 5, (X86reg) (reg & 0x7)); // rm = 101 without SIB: [rip + disp32]
+    push_label(func, label);
+}
+
+void x64_align(X86fn* func, uint32_t alignment) {
+    // Multi-byte nops, as recommended by the Intel manual.
+    static const uint8_t nops[][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0F, 0x1F, 0x00 },
+        { 0x0F, 0x1F, 0x40, 0x00 },
+        { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+
+    uint32_t padding = (alignment - func->buffer_ptr % alignment) % alignment;
+    while (padding) {
+        uint32_t length = padding < 9 ? padding : 9;
+        for (uint32_t i = 0; i < length; ++i)
+            push_byte(func, nops[length - 1][i]);
+
+        padding -= length;
+    }
 }
 
 /////////
@@ -169,77 +371,171 @@ int x64_release(X86fn* func) {
 
 // Immediate
 
-void x64_mov_regimm32(X86fn* func, X86reg reg, uint32_t imm) {
-    bool rex_r = reg >> 3;
-    if (rex_r)
-        push_rex(func, 0, rex_r, 0, 0);
+void x64_mov_regimm8(X86fn* func, X86reg reg, uint8_t imm) {
+    push_rex_opt(func, false, EAX, NO_INDEX, reg, is_byte_rex(reg));
+    push_byte(func, 0xB0 | (reg & 0x7));
+    push_byte(func, imm);
+}
 
-    reg = (X86reg) (reg & 0x7);
-    push_byte(func, 0xB8 | reg);
+void x64_mov_regimm32(X86fn* func, X86reg reg, uint32_t imm) {
+    push_rex_opt(func, false, EAX, NO_INDEX, reg, false);
+    push_byte(func, 0xB8 | (reg & 0x7));
     push_dword(func, imm);
 }
 
 void x64_mov_regimm64(X86fn* func, X86reg reg, uint64_t imm) {
-    bool rex_r = reg >> 3;
-    reg = (X86reg) (reg & 0x7);
-
-    push_rex(func, 1, rex_r, 0, 0);
-    push_byte(func, 0xB8 | reg); // mov r16/32/64, imm16/32/64
+    push_rex_opt(func, true, EAX, NO_INDEX, reg, false);
+    push_byte(func, 0xB8 | (reg & 0x7)); // mov r16/32/64, imm16/32/64
     push_qword(func, imm);
 }
 
+void x64_mov_memimm8(X86fn* func, X86reg ptr, int32_t displacement, uint8_t imm) {
+    push_opmem(func, 8, 0xC6, 0, ptr, displacement);
+    push_byte(func, imm);
+}
+
 // Move
 
+void x64_mov_regreg8(X86fn* func, X86reg dst, X86reg src) {
+    push_opregreg(func, 8, 0x88, src, dst);
+}
+
+void x64_mov_regreg32(X86fn* func, X86reg dst, X86reg src) {
+    push_opregreg(func, 32, 0x89, src, dst);
+}
+
+void x64_mov_regreg64(X86fn* func, X86reg dst, X86reg src) {
+    push_opregreg(func, 64, 0x89, src, dst);
+}
+
+void x64_movzx_regreg8(X86fn* func, X86reg dst, X86reg src) {
+    // Only the source is a byte register.
+    push_opcode(func, 32, 0x0FB6, dst, NO_INDEX, src, is_byte_rex(src));
+    push_modrm(func, 3, src & 0x7, (X86reg) (dst & 0x7));
+}
+
+void x64_movzx_regreg16(X86fn* func, X86reg dst, X86reg src) {
+    push_opregreg(func, 32, 0x0FB7, dst, src);
+}
+
 void x64_movzx_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    // the prefix should be between REX and primary opcode
-    bool rex_b = ptr >> 3;
-    bool rex_r = reg >> 3;
-    push_rex(func, 1, rex_r, 0, rex_b);
-    push_byte(func, 0x0f); // this will break if used with r8 and more.
-    push_opmemreg(func, 0xB6, reg, ptr, displacement);
+    push_opmemreg(func, 32, 0x0FB6, reg, ptr, displacement);
 }
 
 void x64_movzx_regmem16(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    // this will break if used with r8 and more.
-    // the prefix should be between REX and primary opcode
-    bool rex_b = ptr >> 3;
-    bool rex_r = reg >> 3;
-    push_rex(func, 1, rex_r, 0, rex_b);
-    push_byte(func, 0x0f);
-    push_opmemreg(func, 0xB7, reg, ptr, displacement);
+    push_opmemreg(func, 32, 0x0FB7, reg, ptr, displacement);
 }
 
-
 void x64_mov_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0x8A, reg, ptr, displacement);
+    push_opmemreg(func, 8, 0x8A, reg, ptr, displacement);
 }
 
 void x64_mov_regmem16(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    push_byte(func, 0x66); //  Operand-Size prefix
-    push_opmemreg(func, 0x8B, reg, ptr, displacement);
+    push_opmemreg(func, 16, 0x8B, reg, ptr, displacement);
 }
 
 void x64_mov_regmem32(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0x8B, reg, ptr, displacement);
+    push_opmemreg(func, 32, 0x8B, reg, ptr, displacement);
+}
+
+void x64_mov_regmem64(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
+    push_opmemreg(func, 64, 0x8B, reg, ptr, displacement);
 }
 
 void x64_mov_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x88, reg, ptr, displacement);
+    push_opmemreg(func, 8, 0x88, reg, ptr, displacement);
 }
 
 void x64_mov_memreg16(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_byte(func, 0x66); //  Operand-Size prefix
-    push_opmemreg(func, 0x89, reg, ptr, displacement);
+    push_opmemreg(func, 16, 0x89, reg, ptr, displacement);
 }
 
 void x64_mov_memreg32(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x89, reg, ptr, displacement);
+    push_opmemreg(func, 32, 0x89, reg, ptr, displacement);
+}
+
+void x64_mov_memreg64(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
+    push_opmemreg(func, 64, 0x89, reg, ptr, displacement);
+}
+
+void x64_mov_memimm32(X86fn* func, X86reg ptr, int32_t displacement, uint32_t imm) {
+    push_opmem(func, 32, 0xC7, 0, ptr, displacement);
+    push_dword(func, imm);
+}
+
+// Indexed move
+
+void x64_mov_regidx8(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement) {
+    push_opidxreg(func, 8, 0x8A, reg, ptr, index, scale, displacement);
+}
+
+void x64_mov_regidx64(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement) {
+    push_opidxreg(func, 64, 0x8B, reg, ptr, index, scale, displacement);
+}
+
+void x64_movzx_regidx16(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement) {
+    push_opidxreg(func, 32, 0x0FB7, reg, ptr, index, scale, displacement);
+}
+
+void x64_mov_idxreg8(X86fn* func, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement, X86reg reg) {
+    push_opidxreg(func, 8, 0x88, reg, ptr, index, scale, displacement);
+}
+
+void x64_mov_idxreg16(X86fn* func, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement, X86reg reg) {
+    push_opidxreg(func, 16, 0x89, reg, ptr, index, scale, displacement);
+}
+
+void x64_mov_idxreg64(X86fn* func, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement, X86reg reg) {
+    push_opidxreg(func, 64, 0x89, reg, ptr, index, scale, displacement);
+}
+
+// Stack
+
+void x64_push_reg(X86fn* func, X86reg reg) {
+    push_rex_opt(func, false, EAX, NO_INDEX, reg, false);
+    push_byte(func, 0x50 | (reg & 0x7));
+}
+
+void x64_pop_reg(X86fn* func, X86reg reg) {
+    push_rex_opt(func, false, EAX, NO_INDEX, reg, false);
+    push_byte(func, 0x58 | (reg & 0x7));
+}
+
+void x64_call_reg(X86fn* func, X86reg reg) {
+    push_opreg(func, 32, 0xFF, 2, reg);
+}
+
+void x64_jmp_reg(X86fn* func, X86reg reg) {
+    push_opreg(func, 32, 0xFF, 4, reg);
 }
 
 void x64_retn(X86fn* func) {
     push_byte(func, 0xC3);
 }
 
+/** Whether pushing count registers leaves the stack misaligned, the return address taking 8 bytes */
+static bool needs_padding(uint8_t count) {
+    return count % 2 == 0;
+}
+
+void x64_prologue(X86fn* func, const X86reg* saved, uint8_t count) {
+    for (uint8_t i = 0; i < count; ++i)
+        x64_push_reg(func, saved[i]);
+
+    if (needs_padding(count))
+        x64_alu_regimm64(func, X64_SUB, ESP, 8);
+}
+
+void x64_epilogue(X86fn* func, const X86reg* saved, uint8_t count) {
+    if (needs_padding(count))
+        x64_alu_regimm64(func, X64_ADD, ESP, 8);
+
+    for (uint8_t i = count; i > 0; --i)
+        x64_pop_reg(func, saved[i - 1]);
+
+    x64_retn(func);
+}
+
 // add
 void x64_add_aximm8(X86fn* func, uint8_t imm) {
     push_byte(func, 0x66);
@@ -249,114 +545,212 @@ void x64_add_aximm8(X86fn* func, uint8_t imm) {
 }
 
 void x64_add_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x00, reg, ptr, displacement);
+    x64_alu_memreg8(func, X64_ADD, ptr, displacement, reg);
 }
 
 void x64_add_memreg16(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_byte(func, 0x66); //  Operand-Size prefix
-    push_opmemreg(func, 0x01, reg, ptr, displacement);
+    push_opmemreg(func, 16, 0x01, reg, ptr, displacement);
 }
 
 void x64_add_memreg32(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x01, reg, ptr, displacement);
+    push_opmemreg(func, 32, 0x01, reg, ptr, displacement);
+}
+
+void x64_add_regreg16(X86fn* func, X86reg dst, X86reg src) {
+    push_opregreg(func, 16, 0x01, src, dst);
+}
+
+void x64_add_regimm16(X86fn* func, X86reg reg, uint16_t imm) {
+    push_opreg(func, 16, 0x81, 0, reg);
+    push_byte(func, imm & 0xFF);
+    push_byte(func, imm >> 8);
+}
+
+void x64_add_regimm32(X86fn* func, X86reg reg, uint32_t imm) {
+    push_opreg(func, 32, 0x81, 0, reg);
+    push_dword(func, imm);
+}
+
+void x64_add_regreg64(X86fn* func, X86reg reg, X86reg ptr) {
+    push_opregreg(func, 64, 0x03, reg, ptr);
 }
 
 // inc/dec
 
 void x64_inc_mem8(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0xfe, 0, ptr, displacement);
+    push_opmem(func, 8, 0xfe, 0, ptr, displacement);
 }
 
 void x64_dec_mem8(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0xfe, 1, ptr, displacement);
+    push_opmem(func, 8, 0xfe, 1, ptr, displacement);
 }
 
 void x64_inc_mem32(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0xff, 0, ptr, displacement);    
+    push_opmem(func, 32, 0xff, 0, ptr, displacement);
 }
 
 void x64_dec_mem32(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0xff, 1, ptr, displacement);    
+    push_opmem(func, 32, 0xff, 1, ptr, displacement);
+}
+
+void x64_inc_reg32(X86fn* func, X86reg reg) {
+    push_opreg(func, 32, 0xff, 0, reg);
+}
+
+void x64_dec_reg32(X86fn* func, X86reg reg) {
+    push_opreg(func, 32, 0xff, 1, reg);
+}
+
+// Arithmetic & logic, 8 bits
+
+void x64_alu_regreg8(X86fn* func, X64Alu op, X86reg dst, X86reg src) {
+    push_opregreg(func, 8, op << 3, src, dst); // op r/m8, r8
+}
+
+void x64_alu_regmem8(X86fn* func, X64Alu op, X86reg reg, X86reg ptr, int32_t displacement) {
+    push_opmemreg(func, 8, (op << 3) | 2, reg, ptr, displacement); // op r8, r/m8
+}
+
+void x64_alu_memreg8(X86fn* func, X64Alu op, X86reg ptr, int32_t displacement, X86reg reg) {
+    push_opmemreg(func, 8, op << 3, reg, ptr, displacement); // op r/m8, r8
+}
+
+void x64_alu_regimm8(X86fn* func, X64Alu op, X86reg reg, uint8_t imm) {
+    push_opreg(func, 8, 0x80, op, reg);
+    push_byte(func, imm);
+}
+
+void x64_alu_regreg32(X86fn* func, X64Alu op, X86reg dst, X86reg src) {
+    push_opregreg(func, 32, op << 3 | 0x01, src, dst); // op r/m32, r32
+}
+
+void x64_div_reg32(X86fn* func, X86reg reg) {
+    push_opreg(func, 32, 0xf7, 6, reg);
+}
+
+void x64_imul_regregimm32(X86fn* func, X86reg dst, X86reg src, uint32_t imm) {
+    push_opregreg(func, 32, 0x69, dst, src);
+    push_dword(func, imm);
+}
+
+void x64_alu_regimm32(X86fn* func, X64Alu op, X86reg reg, uint32_t imm) {
+    push_opreg(func, 32, 0x81, op, reg);
+    push_dword(func, imm);
+}
+
+void x64_alu_regimm64(X86fn* func, X64Alu op, X86reg reg, uint32_t imm) {
+    push_opreg(func, 64, 0x81, op, reg);
+    push_dword(func, imm);
+}
+
+void x64_alu_memimm8(X86fn* func, X64Alu op, X86reg ptr, int32_t displacement, uint8_t imm) {
+    push_opmem(func, 8, 0x80, op, ptr, displacement);
+    push_byte(func, imm);
 }
 
 // others, 8 bits
 
 void x64_cmp_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0x3A, reg, ptr, displacement);
+    x64_alu_regmem8(func, X64_CMP, reg, ptr, displacement);
+}
+
+void x64_cmp_regmem32(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
+    push_opmemreg(func, 32, 0x3B, reg, ptr, displacement);
 }
 
 void x64_or_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x08, reg, ptr, displacement);
+    x64_alu_memreg8(func, X64_OR, ptr, displacement, reg);
 }
 
 void x64_and_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x20, reg, ptr, displacement);
+    x64_alu_memreg8(func, X64_AND, ptr, displacement, reg);
 }
 
 void x64_xor_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x30, reg, ptr, displacement);
+    x64_alu_memreg8(func, X64_XOR, ptr, displacement, reg);
 }
 
 // jumps
 void x64_jz8(X86fn* func, int8_t distance) {
-    push_byte(func, 0x74);
-    push_byte(func, (uint8_t) distance);
+    x64_jcc8(func, X64_Z, distance);
 }
 
 void x64_jnz8(X86fn* func, int8_t distance) {
-    push_byte(func, 0x75);
+    x64_jcc8(func, X64_NZ, distance);
+}
+
+void x64_jae8(X86fn* func, int8_t distance) {
+    x64_jcc8(func, X64_NC, distance);
+}
+
+void x64_jmp8(X86fn* func, int8_t distance) {
+    push_byte(func, 0xEB);
     push_byte(func, (uint8_t) distance);
 }
 
+void x64_jcc8(X86fn* func, X64Cond cond, int8_t distance) {
+    push_byte(func, 0x70 | cond);
+    push_byte(func, (uint8_t) distance);
+}
 
-void x64_setc(X86fn* func, X86reg ptr, int32_t displacement) {
+void x64_jcc32(X86fn* func, X64Cond cond, int32_t distance) {
     push_byte(func, 0x0F);
-    push_byte(func, 0x92);
-    
-    if (displacement < 256) { // compiler seems to consider the limit is 127
-        push_modrm(func, 1, ptr, 0);
-        push_byte(func, displacement); // disp8
-    }
-    else {
-        push_modrm(func, 2, ptr, 0);
-        push_dword(func, displacement); // disp32
-    }
+    push_byte(func, 0x80 | cond);
+    push_dword(func, (uint32_t) distance);
+}
+
+// flags
+
+void x64_setcc_reg8(X86fn* func, X64Cond cond, X86reg reg) {
+    push_opreg(func, 8, 0x0F90 | cond, 0, reg);
+}
+
+void x64_setcc_mem8(X86fn* func, X64Cond cond, X86reg ptr, int32_t displacement) {
+    push_opmem(func, 8, 0x0F90 | cond, 0, ptr, displacement);
+}
+
+void x64_setc(X86fn* func, X86reg ptr, int32_t displacement) {
+    x64_setcc_mem8(func, X64_C, ptr, displacement);
 }
 
 void x64_setnc(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_byte(func, 0x0F);
-    push_byte(func, 0x93);
-    
-    if (displacement < 256) { // compiler seems to consider the limit is 127
-        push_modrm(func, 1, ptr, 0);
-        push_byte(func, displacement); // disp8
-    }
-    else {
-        push_modrm(func, 2, ptr, 0);
-        push_dword(func, displacement); // disp32
-    }
+    x64_setcc_mem8(func, X64_NC, ptr, displacement);
 }
 
 void x64_sub_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg) {
-    push_opmemreg(func, 0x28, reg, ptr, displacement);
+    x64_alu_memreg8(func, X64_SUB, ptr, displacement, reg);
 }
 
 void x64_shr_memreg8(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0xd0, 5, ptr, displacement);
+    push_opmem(func, 8, 0xd0, 5, ptr, displacement);
 }
 
 void x64_shl_memreg8(X86fn* func, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0xd0, 4, ptr, displacement);
+    push_opmem(func, 8, 0xd0, 4, ptr, displacement);
 }
 
-void x64_sub_regreg8(X86fn* func, X86reg ptr, X86reg reg) {
-    push_opregreg(func, 0x28, reg, ptr);
+void x64_shr_reg8(X86fn* func, X86reg reg) {
+    push_opreg(func, 8, 0xd0, 5, reg);
 }
 
-void x64_sub_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
-    push_opmemreg(func, 0x2A, reg, ptr, displacement);
+void x64_shl_reg8(X86fn* func, X86reg reg) {
+    push_opreg(func, 8, 0xd0, 4, reg);
 }
 
-void x64_add_regreg64(X86fn* func, X86reg reg, X86reg ptr) {
-    push_opregreg64(func, 0x03, reg, ptr);
+void x64_shr_regimm32(X86fn* func, X86reg reg, uint8_t imm) {
+    push_opreg(func, 32, 0xc1, 5, reg);
+    push_byte(func, imm);
+}
+
+void x64_shl_regimm32(X86fn* func, X86reg reg, uint8_t imm) {
+    push_opreg(func, 32, 0xc1, 4, reg);
+    push_byte(func, imm);
+}
+
+void x64_sub_regreg8(X86fn* func, X86reg ptr, X86reg reg) {
+    x64_alu_regreg8(func, X64_SUB, ptr, reg);
+}
+
+void x64_sub_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement) {
+    x64_alu_regmem8(func, X64_SUB, reg, ptr, displacement);
 }
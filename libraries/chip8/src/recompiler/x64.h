@@ -11,41 +11,197 @@ typedef enum
 	AH = 4,
 	CH = 5,
 	DH = 6,
-	BH = 7
+	BH = 7,
+	R8 = 8,
+	R9 = 9,
+	R10 = 10,
+	R11 = 11,
+	R12 = 12,
+	R13 = 13,
+	R14 = 14,
+	R15 = 15,
+
+	// With 32/64 bits operands (and 8 bits operands with a REX prefix), 4...7 are those.
+	ESP = 4,
+	EBP = 5,
+	ESI = 6,
+	EDI = 7,
 } X86reg;
 
+/** Arithmetic & logic operations sharing the same encodings (value is the opcode extension) */
+typedef enum
+{
+	X64_ADD = 0,
+	X64_OR = 1,
+	X64_AND = 4,
+	X64_SUB = 5,
+	X64_XOR = 6,
+	X64_CMP = 7,
+} X64Alu;
+
+/** Condition codes, for jcc and setcc */
+typedef enum
+{
+	X64_C = 0x2,  // carry (below)
+	X64_NC = 0x3, // no carry (above or equal)
+	X64_Z = 0x4,  // zero (equal)
+	X64_NZ = 0x5, // not zero (not equal)
+	X64_A = 0x7,  // above
+	X64_S = 0x8,  // sign (negative)
+	X64_NS = 0x9, // not sign
+} X64Cond;
+
+/** Scale of the index of a memory operand, [ptr + index * scale + displacement] */
+typedef enum
+{
+	X64_SCALE_1 = 0,
+	X64_SCALE_2 = 1,
+	X64_SCALE_4 = 2,
+	X64_SCALE_8 = 3,
+} X64Scale;
+
+/** Function being written, inside of an arena */
 typedef struct {
     uint8_t* buffer;
     uint32_t buffer_size;
     uint32_t buffer_ptr;
-    bool executable;
 } X86fn;
 
-int x64_init(X86fn* fn, uint32_t size);
-int x64_lock(X86fn* fn);
-int x64_run(X86fn* fn);
-int x64_release(X86fn* func);
+/**
+ * Executable memory shared by many functions.
+ *
+ * Functions are bump-allocated, and the whole arena is switched between writable
+ * and executable (W^X), so that writing many functions only costs two syscalls.
+ */
+typedef struct {
+    uint8_t* buffer;
+    uint32_t size;
+    uint32_t used;
+    bool executable;
+} X64Arena;
+
+/** Alignment of functions in an arena, to start on an i-cache fetch block */
+#define X64_ALIGN 16
+
+int x64_arena_init(X64Arena* arena, uint32_t size);
+int x64_arena_release(X64Arena* arena);
+int x64_arena_lock(X64Arena* arena);   // Make arena executable
+int x64_arena_unlock(X64Arena* arena); // Make arena writable
+void x64_arena_reset(X64Arena* arena); // Drop all functions
+
+// Start writing a function of at most size bytes at the end of an unlocked arena.
+int x64_arena_begin(X64Arena* arena, X86fn* func, uint32_t size);
+
+// Keep the function, so that the next one is written after it.
+void x64_arena_end(X64Arena* arena, X86fn* func);
+
+// Call a function of a locked arena, with a pointer as first argument.
+int x64_run(X64Arena* arena, uint8_t* code, void* argument);
+
+//////////
+// Links
+//////////
+
+/** Size of a patchable jump slot (mov rax, imm64 + jmp rax) */
+#define X64_LINK_SLOT_SIZE 12
+
+// Emit a slot which does nothing until it gets patched, returns its offset.
+uint32_t x64_link_slot(X86fn* func);
 
+// Patch a slot into an absolute jump to target (arena must be unlocked).
+void x64_link(X86fn* func, uint32_t slot, uint8_t* target);
+
+// Revert a patched slot, so that it does nothing again (arena must be unlocked).
+void x64_unlink(X86fn* func, uint32_t slot);
+
+// Pad with nops until next multiple of alignment.
+void x64_align(X86fn* func, uint32_t alignment);
+
+//////////
+// Labels
+//////////
+
+/** Maximum number of jumps to a label before it gets bound */
+/**
+ * Position in a function, which can be referred to before it is known.
+ *
+ * Jumps back to a bound label pick the shortest encoding. Jumps ahead use 32 bits
+ * displacements, which are patched once the label gets bound. Until then, each of them
+ * holds the offset of the previous one, so that any number of them can wait for the label.
+ */
+typedef struct {
+    int32_t offset;  // Offset in the function once bound, -1 until then.
+    int32_t pending; // Offset of the last displacement waiting for the label, -1 when none.
+} X64Label;
+
+void x64_label_init(X64Label* label);
+
+// Make the label point here, and patch the instructions which referred to it.
+void x64_label_bind(X86fn* func, X64Label* label);
+
+void x64_jcc_label(X86fn* func, X64Cond cond, X64Label* label);
+void x64_jmp_label(X86fn* func, X64Label* label);
+void x64_lea_label(X86fn* func, X86reg reg, X64Label* label); // reg <- address of the label
+
+//////////
+// Stack
+//////////
+
+void x64_push_reg(X86fn* func, X86reg reg);
+void x64_pop_reg(X86fn* func, X86reg reg);
+void x64_call_reg(X86fn* func, X86reg reg);
+void x64_jmp_reg(X86fn* func, X86reg reg);
 void x64_retn(X86fn* func);
 
+// Save callee-saved registers, and keep the stack 16 bytes aligned for calls.
+void x64_prologue(X86fn* func, const X86reg* saved, uint8_t count);
+
+// Restore registers saved by x64_prologue, and return.
+void x64_epilogue(X86fn* func, const X86reg* saved, uint8_t count);
+
 //////////
 // Move
 //////////
 
 // reg <- immediate
+void x64_mov_regimm8(X86fn* func, X86reg reg, uint8_t imm);
 void x64_mov_regimm32(X86fn* func, X86reg reg, uint32_t imm);
 void x64_mov_regimm64(X86fn* func, X86reg reg, uint64_t imm);
 
+// memory <- immediate
+void x64_mov_memimm8(X86fn* func, X86reg ptr, int32_t displacement, uint8_t imm);
+void x64_mov_memimm32(X86fn* func, X86reg ptr, int32_t displacement, uint32_t imm);
+
+// reg <- reg
+void x64_mov_regreg8(X86fn* func, X86reg dst, X86reg src);
+void x64_mov_regreg32(X86fn* func, X86reg dst, X86reg src);
+void x64_mov_regreg64(X86fn* func, X86reg dst, X86reg src);
+void x64_movzx_regreg8(X86fn* func, X86reg dst, X86reg src);
+void x64_movzx_regreg16(X86fn* func, X86reg dst, X86reg src);
+
 // reg <- memory
 void x64_mov_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 void x64_mov_regmem16(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 void x64_mov_regmem32(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
+void x64_mov_regmem64(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 void x64_movzx_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 void x64_movzx_regmem16(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 
 // memory <- reg
 void x64_mov_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
 void x64_mov_memreg16(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
+void x64_mov_memreg32(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
+void x64_mov_memreg64(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
+
+// reg <- [ptr + index * scale + displacement]
+void x64_mov_regidx8(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement);
+void x64_mov_regidx64(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement);
+void x64_movzx_regidx16(X86fn* func, X86reg reg, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement);
+
+// [ptr + index * scale + displacement] <- reg (rsp cannot be an index)
+void x64_mov_idxreg8(X86fn* func, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement, X86reg reg);
+void x64_mov_idxreg16(X86fn* func, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement, X86reg reg);
+void x64_mov_idxreg64(X86fn* func, X86reg ptr, X86reg index, X64Scale scale, int32_t displacement, X86reg reg);
 
 //////////
 // Add
@@ -54,6 +210,10 @@ void x64_add_aximm8(X86fn* func, uint8_t imm);
 void x64_add_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
 void x64_add_memreg16(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
 void x64_add_memreg32(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
+void x64_add_regreg16(X86fn* func, X86reg dst, X86reg src);
+void x64_add_regimm16(X86fn* func, X86reg reg, uint16_t imm);
+void x64_add_regimm32(X86fn* func, X86reg reg, uint32_t imm);
+void x64_add_regreg64(X86fn* func, X86reg reg, X86reg ptr);
 
 //////////
 // Inc/Dec
@@ -63,12 +223,27 @@ void x64_inc_mem8(X86fn* func, X86reg ptr, int32_t displacement);
 void x64_dec_mem8(X86fn* func, X86reg ptr, int32_t displacement);
 void x64_inc_mem32(X86fn* func, X86reg ptr, int32_t displacement);
 void x64_dec_mem32(X86fn* func, X86reg ptr, int32_t displacement);
+void x64_inc_reg32(X86fn* func, X86reg reg);
+void x64_dec_reg32(X86fn* func, X86reg reg);
 
 //////////
 // 8 bits ops
 //////////
 
+// dst <- dst op src
+void x64_alu_regreg8(X86fn* func, X64Alu op, X86reg dst, X86reg src);
+void x64_alu_regmem8(X86fn* func, X64Alu op, X86reg reg, X86reg ptr, int32_t displacement);
+void x64_alu_memreg8(X86fn* func, X64Alu op, X86reg ptr, int32_t displacement, X86reg reg);
+void x64_alu_regimm8(X86fn* func, X64Alu op, X86reg reg, uint8_t imm);
+void x64_alu_regreg32(X86fn* func, X64Alu op, X86reg dst, X86reg src);
+void x64_alu_regimm32(X86fn* func, X64Alu op, X86reg reg, uint32_t imm);
+void x64_imul_regregimm32(X86fn* func, X86reg dst, X86reg src, uint32_t imm);
+void x64_div_reg32(X86fn* func, X86reg reg); // edx:eax / reg, quotient in eax and remainder in edx
+void x64_alu_regimm64(X86fn* func, X64Alu op, X86reg reg, uint32_t imm);
+void x64_alu_memimm8(X86fn* func, X64Alu op, X86reg ptr, int32_t displacement, uint8_t imm);
+
 void x64_cmp_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
+void x64_cmp_regmem32(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 
 void x64_or_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
 void x64_and_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
@@ -81,17 +256,25 @@ void x64_xor_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
 
 void x64_jz8(X86fn* func, int8_t distance);
 void x64_jnz8(X86fn* func, int8_t distance);
+void x64_jae8(X86fn* func, int8_t distance);
+void x64_jmp8(X86fn* func, int8_t distance);
+void x64_jcc8(X86fn* func, X64Cond cond, int8_t distance);
+void x64_jcc32(X86fn* func, X64Cond cond, int32_t distance);
 
 
 void x64_setc(X86fn* func, X86reg ptr, int32_t displacement);
 void x64_setnc(X86fn* func, X86reg ptr, int32_t displacement);
+void x64_setcc_reg8(X86fn* func, X64Cond cond, X86reg reg);
+void x64_setcc_mem8(X86fn* func, X64Cond cond, X86reg ptr, int32_t displacement);
 
 void x64_sub_memreg8(X86fn* func, X86reg ptr, int32_t displacement, X86reg reg);
 void x64_shr_memreg8(X86fn* func, X86reg ptr, int32_t displacement);
 void x64_shl_memreg8(X86fn* func, X86reg ptr, int32_t displacement);
+void x64_shr_reg8(X86fn* func, X86reg reg);
+void x64_shl_reg8(X86fn* func, X86reg reg);
+void x64_shr_regimm32(X86fn* func, X86reg reg, uint8_t imm);
+void x64_shl_regimm32(X86fn* func, X86reg reg, uint8_t imm);
 
 void x64_sub_regreg8(X86fn* func, X86reg ptr, X86reg reg);
 void x64_sub_regmem8(X86fn* func, X86reg reg, X86reg ptr, int32_t displacement);
 
-void x64_add_regreg64(X86fn* func, X86reg reg, X86reg ptr);
-
@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include "threaded.h"
+#include "../interpreter/interpreter.h"
+
+/** Jump to the handler of the instruction at pc, PC out of memory is left to the interpreter */
+#define DISPATCH() do { if (pc >= size) goto interpret; ip = &code[pc]; goto *ip->handler; } while (0)
+
+/** Count the cycle of the instruction which ran, and go on with the next one until cycles_limit */
+#define NEXT(length) do { pc += (length); if (++cycles >= limit) goto leave; DISPATCH(); } while (0)
+
+/**
+ * Length of the instruction which follows address, for skips.
+ * XO-Chip's F000 NNNN is the only instruction which is 4 bytes long.
+ */
+static uint16_t next_length(Chip8* state, uint16_t address) {
+    uint16_t next = address + 2;
+
+    if (state->variant == VARIANT_XO_CHIP && state->memory[next] == 0xF0 && state->memory[next + 1] == 0x00)
+        return 4;
+
+    return 2;
+}
+
+/**
+ * Make instructions overlapping written memory be decoded again.
+ * Skips up to 3 bytes before depend on the length of the instruction which follows them.
+ */
+static void invalidate(ThreadedState* threaded, uint32_t address, uint32_t length) {
+    uint32_t start = address < 3 ? 0 : address - 3;
+
+    for (uint32_t i = start; i < address + length && i < threaded->size; ++i)
+        threaded->code[i].handler = threaded->decoder;
+}
+
+Chip8Error threaded_init(ThreadedState* threaded, Chip8Variant variant) {
+    threaded->size = variant == VARIANT_XO_CHIP ? 65536 : 4096;
+    threaded->code = (ThreadedInstruction*) malloc(threaded->size * sizeof(ThreadedInstruction));
+    threaded->decoder = NULL;
+    return CHIP8_OK;
+}
+
+void threaded_flush(ThreadedState* threaded) {
+    if (threaded->decoder)
+        invalidate(threaded, 0, threaded->size);
+}
+
+void threaded_release(ThreadedState* threaded) {
+    free(threaded->code);
+    threaded->code = NULL;
+}
+
+// Handlers are dispatched with GNU C labels as values, which -pedantic warns about on every use.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+Chip8Error threaded_step(ThreadedState* threaded, Chip8* state) {
+    // Instructions missing here are rare, or mostly spend their time in the display:
+    // they are left to the interpreter.
+    static const void* const handlers[OPCODE_SCRL_UP_N + 1] = {
+        [OPCODE_CLS] = &&cls,
+        [OPCODE_RET] = &&ret,
+        [OPCODE_JMP_NNN] = &&jmp_nnn,
+        [OPCODE_CALL_NNN] = &&call_nnn,
+        [OPCODE_SE_VX_KK] = &&se_vx_kk,
+        [OPCODE_SNE_VX_KK] = &&sne_vx_kk,
+        [OPCODE_SE_VX_VY] = &&se_vx_vy,
+        [OPCODE_LD_VX_KK] = &&ld_vx_kk,
+        [OPCODE_ADD_VX_KK] = &&add_vx_kk,
+        [OPCODE_LD_VX_VY] = &&ld_vx_vy,
+        [OPCODE_OR_VX_VY] = &&or_vx_vy,
+        [OPCODE_AND_VX_VY] = &&and_vx_vy,
+        [OPCODE_XOR_VX_VY] = &&xor_vx_vy,
+        [OPCODE_ADD_VX_VY] = &&add_vx_vy,
+        [OPCODE_SUB_VX_VY] = &&sub_vx_vy,
+        [OPCODE_SHR_VX_VY] = &&shr_vx_vy,
+        [OPCODE_SUBN_VX_VY] = &&subn_vx_vy,
+        [OPCODE_SHL_VX_VY] = &&shl_vx_vy,
+        [OPCODE_SNE_VX_VY] = &&sne_vx_vy,
+        [OPCODE_LD_I_NNN] = &&ld_i_nnn,
+        [OPCODE_JP_V0_NNN] = &&jp_v0_nnn,
+        [OPCODE_RND_VX_KK] = &&rnd_vx_kk,
+        [OPCODE_DRW_VX_VY_N] = &&drw_vx_vy_n,
+        [OPCODE_SKP_VX] = &&skp_vx,
+        [OPCODE_SKNP_VX] = &&sknp_vx,
+        [OPCODE_LD_VX_DT] = &&ld_vx_dt,
+        [OPCODE_LD_VX_K] = &&ld_vx_k,
+        [OPCODE_LD_DT_VX] = &&ld_dt_vx,
+        [OPCODE_LD_ST_VX] = &&ld_st_vx,
+        [OPCODE_ADD_I_VX] = &&add_i_vx,
+        [OPCODE_LD_F_VX] = &&ld_f_vx,
+        [OPCODE_LD_B_VX] = &&ld_b_vx,
+        [OPCODE_LD_I_VX] = &&ld_i_vx,
+        [OPCODE_LD_VX_I] = &&ld_vx_i,
+        [OPCODE_LD_I_VX_VY] = &&ld_i_vx_vy,
+        [OPCODE_LD_VX_VY_I] = &&ld_vx_vy_i,
+    };
+
+    // Entries point to the decoder until decoded, its address is only known here.
+    if (!threaded->decoder) {
+        threaded->decoder = &&decode;
+        threaded_flush(threaded);
+    }
+
+    ThreadedInstruction* code = threaded->code;
+    uint32_t size = threaded->size;
+    ThreadedInstruction* ip;
+    uint8_t* V = state->registers;
+    uint16_t pc = state->PC;
+    uint32_t cycles = state->cycles_since_started;
+    uint32_t limit = state->cycles_limit;
+    Chip8Error error = CHIP8_OK;
+
+    DISPATCH();
+
+decode: {
+        Chip8Opcode opcode;
+        chip8_decode(state, &opcode, pc);
+
+        ip->handler = handlers[opcode.id] ? handlers[opcode.id] : &&interpret;
+        ip->x = opcode.x;
+        ip->y = opcode.y;
+        ip->n = opcode.n;
+        ip->kk = opcode.kk;
+        ip->nnn = opcode.nnn;
+        ip->skip = 2 + next_length(state, pc);
+        ip->idle = opcode.id == OPCODE_JMP_NNN && chip8_idle_loop(state, opcode.nnn, pc);
+        goto *ip->handler;
+    }
+
+interpret:
+    state->PC = pc;
+    state->cycles_since_started = cycles;
+    error = interpreter_step(state);
+    pc = state->PC;
+    cycles = state->cycles_since_started;
+
+    if (error != CHIP8_OK || cycles >= limit)
+        goto leave;
+    DISPATCH();
+
+cls:
+    chip8_clear_display(state);
+    NEXT(2);
+
+ret:
+    if (state->SP == 0) {
+        error = CHIP8_CALL_STACK_EMPTY;
+        goto leave;
+    }
+    state->SP--;
+    pc = state->stack[state->SP] + 2;
+    NEXT(0);
+
+jmp_nnn:
+    // The interpreter skips the iterations of idle loops which are left until cycles_limit.
+    if (ip->idle && cycles + 1 < limit)
+        goto interpret;
+    pc = ip->nnn;
+    NEXT(0);
+
+call_nnn:
+    if (state->SP >= 16) {
+        error = CHIP8_CALL_STACK_FULL;
+        goto leave;
+    }
+    state->stack[state->SP++] = pc;
+    pc = ip->nnn;
+    NEXT(0);
+
+se_vx_kk:
+    NEXT(V[ip->x] == ip->kk ? ip->skip : 2);
+
+sne_vx_kk:
+    NEXT(V[ip->x] != ip->kk ? ip->skip : 2);
+
+se_vx_vy:
+    NEXT(V[ip->x] == V[ip->y] ? ip->skip : 2);
+
+ld_vx_kk:
+    V[ip->x] = ip->kk;
+    NEXT(2);
+
+add_vx_kk:
+    V[ip->x] += ip->kk;
+    NEXT(2);
+
+ld_vx_vy:
+    V[ip->x] = V[ip->y];
+    NEXT(2);
+
+or_vx_vy:
+    V[ip->x] |= V[ip->y];
+    NEXT(2);
+
+and_vx_vy:
+    V[ip->x] &= V[ip->y];
+    NEXT(2);
+
+xor_vx_vy:
+    V[ip->x] ^= V[ip->y];
+    NEXT(2);
+
+add_vx_vy:
+    V[15] = (uint16_t) V[ip->x] + (uint16_t) V[ip->y] > 255;
+    V[ip->x] += V[ip->y];
+    NEXT(2);
+
+sub_vx_vy:
+    V[15] = V[ip->x] > V[ip->y];
+    V[ip->x] -= V[ip->y];
+    NEXT(2);
+
+shr_vx_vy:
+    V[15] = V[ip->x] & 0x1;
+    V[ip->x] >>= 1;
+    NEXT(2);
+
+subn_vx_vy:
+    V[15] = V[ip->y] > V[ip->x];
+    V[ip->x] = V[ip->y] - V[ip->x];
+    NEXT(2);
+
+shl_vx_vy:
+    V[15] = V[ip->x] >> 7;
+    V[ip->x] <<= 1;
+    NEXT(2);
+
+sne_vx_vy:
+    NEXT(V[ip->x] != V[ip->y] ? ip->skip : 2);
+
+ld_i_nnn:
+    state->I = ip->nnn;
+    NEXT(2);
+
+jp_v0_nnn:
+    pc = V[0] + ip->nnn;
+    NEXT(0);
+
+rnd_vx_kk:
+    V[ip->x] = ip->kk & rand();
+    NEXT(2);
+
+drw_vx_vy_n:
+    chip8_draw_sprite(state, V[ip->x], V[ip->y], ip->n);
+    NEXT(2);
+
+skp_vx:
+    NEXT(state->keyboard[V[ip->x] & 0xF] ? ip->skip : 2);
+
+sknp_vx:
+    NEXT(state->keyboard[V[ip->x] & 0xF] ? 2 : ip->skip);
+
+ld_vx_dt:
+    V[ip->x] = state->DT;
+    NEXT(2);
+
+ld_vx_k: {
+        int32_t key = chip8_pressed_key(state);
+        if (key != -1) {
+            V[ip->x] = key;
+            NEXT(2);
+        }
+
+        // Keys do not change until cycles_limit: wait until then.
+        if (cycles + 1 < limit)
+            cycles = limit - 1;
+        NEXT(0);
+    }
+
+ld_dt_vx:
+    state->DT = V[ip->x];
+    NEXT(2);
+
+ld_st_vx:
+    state->ST = V[ip->x];
+    NEXT(2);
+
+add_i_vx:
+    state->I += V[ip->x];
+    NEXT(2);
+
+ld_f_vx:
+    state->I = 5 * V[ip->x];
+    NEXT(2);
+
+ld_b_vx: {
+        uint8_t remainder = V[ip->x];
+        for (int i = 0; i < 3; ++i) {
+            state->memory[2 + state->I - i] = remainder % 10;
+            remainder = remainder / 10;
+        }
+
+        invalidate(threaded, state->I, 3);
+        NEXT(2);
+    }
+
+ld_i_vx:
+    for (int i = 0; i <= ip->x; ++i)
+        state->memory[state->I + i] = V[i];
+
+    invalidate(threaded, state->I, ip->x + 1);
+    state->I += ip->x + 1;
+    NEXT(2);
+
+ld_vx_i:
+    for (int i = 0; i <= ip->x; ++i)
+        V[i] = state->memory[state->I + i];
+
+    state->I += ip->x + 1;
+    NEXT(2);
+
+ld_i_vx_vy: {
+        int step = ip->x <= ip->y ? 1 : -1;
+        int length = step * (ip->y - ip->x) + 1;
+        for (int i = 0; i < length; ++i)
+            state->memory[state->I + i] = V[ip->x + step * i];
+
+        invalidate(threaded, state->I, length);
+        NEXT(2);
+    }
+
+ld_vx_vy_i: {
+        int step = ip->x <= ip->y ? 1 : -1;
+        int length = step * (ip->y - ip->x) + 1;
+        for (int i = 0; i < length; ++i)
+            V[ip->x + step * i] = state->memory[state->I + i];
+
+        NEXT(2);
+    }
+
+leave:
+    state->PC = pc;
+    state->cycles_since_started = cycles;
+    return error;
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,39 @@
+#pragma once
+#include "../chip8.h"
+
+/**
+ * Predecoded instruction.
+ *
+ * handler is the address of the code executing it in threaded_step (GNU C labels as values),
+ * operands are extracted once so that handlers do not need to decode anything.
+ */
+typedef struct {
+    const void* handler; // Decoder until the instruction at this address was decoded.
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t kk;
+    uint8_t skip;        // Bytes skipped by a taken skip: this instruction and the next one.
+    uint16_t nnn;
+    bool idle;           // Jump back to a loop which may be idle, when decoded.
+} ThreadedInstruction;
+
+/**
+ * Direct threaded code: the program is decoded into a stream of handler addresses and operands,
+ * which run by jumping from one handler to the next. No machine code is generated.
+ */
+typedef struct {
+    ThreadedInstruction* code; // Indexed by address.
+    uint32_t size;             // Number of entries: one per address of the memory of the variant.
+    const void* decoder;       // Known once threaded_step ran.
+} ThreadedState;
+
+Chip8Error threaded_init(ThreadedState* threaded, Chip8Variant variant);
+
+// Run until cycles_limit (at least one instruction), decoding instructions on first execution.
+Chip8Error threaded_step(ThreadedState* threaded, Chip8* state);
+
+// Decode all instructions again, to be called when the memory of the machine gets replaced.
+void threaded_flush(ThreadedState* threaded);
+
+void threaded_release(ThreadedState* threaded);
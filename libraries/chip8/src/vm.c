@@ -1,54 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
 #include "vm.h"
 
 Chip8Error chip8vm_init(Chip8VirtualMachine* vm, Chip8VirtualMachineType type, Chip8Variant variant, uint32_t clock_speed) {
     vm->type = type;
     
     chip8_init(&vm->state, variant, clock_speed);
+
+    vm->cycles = 0;
+    vm->timer_period = clock_speed / 60;
+    vm->timer_period_remainder = clock_speed % 60;
+    vm->next_timer = vm->timer_period + (vm->timer_period_remainder != 0);
+    vm->timer_remainder = vm->timer_period_remainder;
     if (type == RECOMPILER)
         recompiler_init(&vm->vm_state.recompiler);
 
+    if (type == TIERED) {
+        uint32_t mem_size = variant == VARIANT_XO_CHIP ? 65536 : 4096;
+        recompiler_init(&vm->vm_state.tiered.recompiler);
+        vm->vm_state.tiered.heat = (uint16_t*) calloc(mem_size, sizeof(uint16_t));
+        vm->vm_state.tiered.threshold = CHIP8VM_HOT_THRESHOLD;
+        vm->vm_state.tiered.background = false;
+        vm->vm_state.tiered.recompiler.heat = vm->vm_state.tiered.heat;
+    }
+
+    if (type == THREADED)
+        threaded_init(&vm->vm_state.threaded, variant);
+
     return CHIP8_OK;
 }
 
 Chip8Error chip8vm_load_rom(Chip8VirtualMachine* vm, const char *rom) {
+    // Blocks of the previous ROM cannot be used anymore.
+    if (vm->type == RECOMPILER)
+        recompiler_release(&vm->vm_state.recompiler);
+
+    if (vm->type == TIERED) {
+        uint32_t mem_size = vm->state.variant == VARIANT_XO_CHIP ? 65536 : 4096;
+        recompiler_release(&vm->vm_state.tiered.recompiler);
+        memset(vm->vm_state.tiered.heat, 0, mem_size * sizeof(uint16_t));
+        vm->vm_state.tiered.recompiler.heat = vm->vm_state.tiered.heat;
+    }
+
+    if (vm->type == THREADED)
+        threaded_flush(&vm->vm_state.threaded);
+
     return chip8_load_rom(&vm->state, rom);
 }
 
-Chip8Error chip8vm_run(Chip8VirtualMachine* vm, uint32_t ticks) {
-    uint64_t cycles = ticks * vm->state.clock_speed / 1000;
-    Chip8Error error = CHIP8_OK;
+/**
+ * Interpret one instruction, unless code at PC is translated or hot enough to be.
+ */
+static Chip8Error tiered_step(TieredState* tiered, Chip8* state) {
+    uint16_t* heat = &tiered->heat[state->PC];
+    if (*heat < tiered->threshold)
+        ++*heat;
 
-    while (error == CHIP8_OK && vm->state.cycles_since_started < cycles) {
-        error = chip8vm_step(vm);
+    if (!recompiler_ready(&tiered->recompiler, state)) {
+        if (*heat < tiered->threshold)
+            return interpreter_step(state);
+
+        // Hot code is interpreted until its translation is installed.
+        if (tiered->background) {
+            recompiler_submit(&tiered->recompiler, state);
+            return interpreter_step(state);
+        }
     }
 
+    Chip8Error error = recompiler_step(&tiered->recompiler, state);
+    if (error == CHIP8_OPCODE_NOT_SUPPORTED)
+        error = interpreter_step(state);
+
     return error;
 }
 
-Chip8Error chip8vm_step(Chip8VirtualMachine* vm) {
-    // Save elapsed cycles, to compute timers later on.
-    int32_t cycles_before = vm->state.cycles_since_started;
+/**
+ * Run translated code until cycles_limit, interpreting what the recompiler does not support.
+ */
+static Chip8Error recompiler_run(RecompilerState* recompiler, Chip8* state) {
+    Chip8Error error;
+    do {
+        error = recompiler_step(recompiler, state);
+
+        // Fallback to interpreter for non supported opcodes.
+        if (error == CHIP8_OPCODE_NOT_SUPPORTED)
+            error = interpreter_step(state);
+    } while (error == CHIP8_OK && state->cycles_since_started < state->cycles_limit);
+
+    return error;
+}
+
+/**
+ * Run until cycles_limit, moving to translated code as it gets hot.
+ */
+static Chip8Error tiered_run(TieredState* tiered, Chip8* state) {
+    Chip8Error error;
+    do {
+        error = tiered_step(tiered, state);
+    } while (error == CHIP8_OK && state->cycles_since_started < state->cycles_limit);
+
+    return error;
+}
+
+/**
+ * Schedule the next timer decrement: it comes timer_period cycles later, plus one each time remainders add up to a cycle.
+ */
+static void schedule_timer(Chip8VirtualMachine* vm) {
+    uint64_t exact = vm->next_timer - (vm->timer_remainder != 0);
+
+    vm->timer_remainder += vm->timer_period_remainder;
+    exact += vm->timer_period;
+    if (vm->timer_remainder >= 60) {
+        vm->timer_remainder -= 60;
+        exact++;
+    }
+
+    vm->next_timer = exact + (vm->timer_remainder != 0);
+}
+
+/**
+ * Run the virtual machine for at most one 60Hz slice, and decrement timers.
+ * Execution is given the whole slice, or the cycles left until the end of the run if it comes first.
+ */
+static Chip8Error step(Chip8VirtualMachine* vm, uint64_t cycles) {
+    uint32_t cycles_before = vm->state.cycles_since_started;
+
+    // Chained blocks and idle loops can keep running until the next timer decrement.
+    uint64_t limit = vm->next_timer < cycles ? vm->next_timer : cycles;
+    vm->state.cycles_limit = cycles_before + (uint32_t) (limit - vm->cycles);
 
     // Run virtual machine.
     Chip8Error error;
     if (vm->type == INTERPRETER){
-        error = interpreter_step(&vm->state);
+        error = interpreter_run(&vm->state);
     }
     else if (vm->type == RECOMPILER) {
-        error = recompiler_step(&vm->vm_state.recompiler, &vm->state);
+        error = recompiler_run(&vm->vm_state.recompiler, &vm->state);
+    }
+    else if (vm->type == TIERED) {
+        error = tiered_run(&vm->vm_state.tiered, &vm->state);
+    }
+    else if (vm->type == THREADED) {
+        error = threaded_step(&vm->vm_state.threaded, &vm->state);
+    }
 
-        // Fallback to interpreter for non supported opcodes.
-        if (error == CHIP8_OPCODE_NOT_SUPPORTED)
-            error = interpreter_step(&vm->state);
+    // Decrement timers at 60Hz, regardless of emulation clock speed.
+    vm->cycles += vm->state.cycles_since_started - cycles_before;
+    while (vm->cycles >= vm->next_timer) {
+        if (vm->state.DT) vm->state.DT--;
+        if (vm->state.ST) vm->state.ST--;
+        schedule_timer(vm);
     }
 
-    // Decrement timer at 60Hz, regardless of emulation clock speed.
-    int missed_timers =
-        + vm->state.cycles_since_started * 60 / vm->state.clock_speed // expected timers
-        - cycles_before * 60 / vm->state.clock_speed; // already done timers
+    return error;
+}
+
+Chip8Error chip8vm_run(Chip8VirtualMachine* vm, uint32_t ticks) {
+    uint64_t cycles = (uint64_t) ticks * vm->state.clock_speed / 1000;
+    Chip8Error error = CHIP8_OK;
 
-    vm->state.DT = vm->state.DT < missed_timers ? 0 : vm->state.DT - missed_timers;
-    vm->state.ST = vm->state.ST < missed_timers ? 0 : vm->state.ST - missed_timers;
+    while (error == CHIP8_OK && vm->cycles < cycles) {
+        error = step(vm, cycles);
+    }
 
     return error;
 }
+
+Chip8Error chip8vm_step(Chip8VirtualMachine* vm) {
+    return step(vm, vm->cycles + 1);
+}
+
+void chip8vm_release(Chip8VirtualMachine* vm) {
+    if (vm->type == RECOMPILER)
+        recompiler_release(&vm->vm_state.recompiler);
+
+    if (vm->type == TIERED) {
+        recompiler_release(&vm->vm_state.tiered.recompiler);
+        free(vm->vm_state.tiered.heat);
+        vm->vm_state.tiered.heat = NULL;
+    }
+
+    if (vm->type == THREADED)
+        threaded_release(&vm->vm_state.threaded);
+
+    chip8_release(&vm->state);
+}
@@ -2,24 +2,50 @@
 #include <inttypes.h>
 #include "recompiler/recompiler.h"
 #include "interpreter/interpreter.h"
+#include "threaded/threaded.h"
+
+/** Default number of times an address is interpreted before code starting there gets translated */
+#define CHIP8VM_HOT_THRESHOLD 32
 
 typedef enum {
     INTERPRETER,
     RECOMPILER,
+    TIERED,     // Interpret, and translate code which runs often.
+    THREADED,   // Run predecoded instructions through threaded code, portable to any architecture.
 } Chip8VirtualMachineType;
 
+typedef struct {
+    RecompilerState recompiler;
+    uint16_t* heat;      // Number of times each address was interpreted.
+    uint16_t threshold;  // Heat from which code gets translated, can be changed after init.
+    bool background;     // Translate in a worker thread and keep interpreting until code is ready, false after init.
+} TieredState;
+
 typedef struct {
     Chip8VirtualMachineType type;
     Chip8 state;
 
+    // 60Hz timers, scheduled without dividing: the k-th decrement happens at cycle ceil(k * clock_speed / 60).
+    uint64_t cycles;          // Cycles run since init, cycles_since_started only holds the low 32 bits.
+    uint64_t next_timer;      // Cycle of the next decrement.
+    uint32_t timer_remainder; // k * clock_speed % 60 for the next decrement.
+    uint32_t timer_period;    // clock_speed / 60
+    uint32_t timer_period_remainder; // clock_speed % 60
+
     union
     {
         RecompilerState recompiler;
+        TieredState tiered;
+        ThreadedState threaded;
     } vm_state;
 
 } Chip8VirtualMachine;
 
 Chip8Error chip8vm_init(Chip8VirtualMachine* vm, Chip8VirtualMachineType type, Chip8Variant variant, uint32_t clock_speed);
 Chip8Error chip8vm_load_rom(Chip8VirtualMachine* vm, const char *rom);
+// Run until ticks milliseconds of emulated time since init, one 60Hz slice after the other.
 Chip8Error chip8vm_run(Chip8VirtualMachine* vm, uint32_t ticks);
+
+// Run one instruction, or one pass through a translated block, which may hold several.
 Chip8Error chip8vm_step(Chip8VirtualMachine* vm);
+void chip8vm_release(Chip8VirtualMachine* vm);
@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cmocka.h>
 
 #include <chip8.h>
@@ -18,6 +19,7 @@ static int setup(void **state)
 
 static int teardown(void **state)
 {
+    chip8_release(*state);
     free(*state);
 
     return 0;
@@ -71,6 +73,23 @@ static void test_1nnn(void **state)
     assert_int_equal(chip->PC, 0x210);
 }
 
+/** 1nnn - JP addr, jumping back to wait for DT */
+static void test_1nnn_idle(void **state)
+{
+    // LD V0, DT then JP 0x200
+    Chip8 *chip = load_simple_program(state, 0xf007);
+    chip->memory[0x203] = 0x00;
+    chip->DT = 5;
+    chip->registers[0] = 5;
+    chip->PC = 0x202;
+    chip->cycles_limit = 100;
+
+    // Iterations which would run before cycles_limit are skipped, two cycles each.
+    assert_int_equal(interpreter_step(chip), 0);
+    assert_int_equal(chip->PC, 0x200);
+    assert_int_equal(chip->cycles_since_started, 99);
+}
+
 /** 2nnn - CALL addr */
 static void test_2nnn(void **state)
 {
@@ -361,11 +380,75 @@ static void test_fx33(void **state)
     assert_int_equal(chip->PC, 0x202);
 }
 
-// /** Fx55 - LD [I], Vx */
-// static void test_fx55(void **state)
-// {
-//     Chip8 *chip = load_simple_program(state, 0xfx55);
-// }
+/** Fx55 - LD [I], Vx */
+static void test_fx55(void **state)
+{
+    Chip8 *chip = load_simple_program(state, 0xf155);
+    chip->I = 0x204; // Right after the program, on a page holding translated code.
+    chip->code_pages[0x2] = 1;
+    chip->registers[0] = 0x12;
+    chip->registers[1] = 0x34;
+
+    assert_int_equal(interpreter_step(chip), 0);
+    assert_int_equal(chip->memory[0x204], 0x12);
+    assert_int_equal(chip->memory[0x205], 0x34);
+    assert_int_equal(chip->I, 0x206);
+    assert_int_equal(chip->written_start, 0x204);
+    assert_int_equal(chip->written_end, 0x206);
+    assert_int_equal(chip->PC, 0x202);
+}
+
+/** F000 NNNN - LD I, long NNNN (XO-Chip), and skipping over it */
+static void test_f000_nnnn(void **state)
+{
+    Chip8 *chip = load_simple_program(state, 0x3000);
+    chip->variant = VARIANT_XO_CHIP;
+    chip->memory[0x202] = 0xF0;
+    chip->memory[0x203] = 0x00;
+    chip->memory[0x204] = 0x12;
+    chip->memory[0x205] = 0x34;
+
+    // SE V0, 0 skips the whole 4 bytes instruction.
+    assert_int_equal(interpreter_step(chip), 0);
+    assert_int_equal(chip->PC, 0x206);
+
+    chip->PC = 0x202;
+    assert_int_equal(interpreter_step(chip), 0);
+    assert_int_equal(chip->I, 0x1234);
+    assert_int_equal(chip->PC, 0x206);
+}
+
+/** Instructions kept decoded by interpreter_run are decoded again once overwritten */
+static void test_run_self_modifying(void **state)
+{
+    Chip8 *chip = *state;
+    const uint8_t program[] = {
+        0x71, 0x01,     // 200: ADD V1, 1       patched into ADD V1, 3
+        0x72, 0x01,     // 202: ADD V2, 1
+        0x32, 0x02,     // 204: SE V2, 2
+        0x12, 0x00,     // 206: JP 200
+        0x60, 0x03,     // 208: LD V0, 3
+        0xA2, 0x01,     // 20A: LD I, 201
+        0xF0, 0x55,     // 20C: LD [I], V0
+        0x62, 0x01,     // 20E: LD V2, 1
+        0x12, 0x00,     // 210: JP 200
+    };
+    memcpy(chip->memory + 0x200, program, sizeof program);
+
+    // 200 runs twice, then once patched.
+    chip->cycles_limit = 13;
+    assert_int_equal(interpreter_run(chip), 0);
+    assert_int_equal(chip->PC, 0x202);
+    assert_int_equal(chip->registers[1], 1 + 1 + 3);
+
+    // Callers writing memory mark it written too.
+    chip->memory[0x201] = 0x10;
+    chip8_mark_written(chip, 0x201, 1);
+    chip->PC = 0x200;
+    chip->cycles_limit++;
+    assert_int_equal(interpreter_run(chip), 0);
+    assert_int_equal(chip->registers[1], 5 + 0x10);
+}
 
 // /** Fx65 - LD Vx, [I] */
 // static void test_fx65(void **state)
@@ -379,6 +462,7 @@ int main(void)
         cmocka_unit_test_setup_teardown(test_00e0, setup, teardown),
         cmocka_unit_test_setup_teardown(test_00ee, setup, teardown),
         cmocka_unit_test_setup_teardown(test_1nnn, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_1nnn_idle, setup, teardown),
         cmocka_unit_test_setup_teardown(test_2nnn, setup, teardown),
         cmocka_unit_test_setup_teardown(test_3xkk_equal, setup, teardown),
         cmocka_unit_test_setup_teardown(test_3xkk_notequal, setup, teardown),
@@ -411,8 +495,10 @@ int main(void)
         // cmocka_unit_test_setup_teardown(test_fx1e, setup, teardown),
         // cmocka_unit_test_setup_teardown(test_fx29, setup, teardown),
         cmocka_unit_test_setup_teardown(test_fx33, setup, teardown),
-        // cmocka_unit_test_setup_teardown(test_fx55, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fx55, setup, teardown),
         // cmocka_unit_test_setup_teardown(test_fx65, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_f000_nnnn, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_run_self_modifying, setup, teardown),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,857 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cmocka.h>
+
+#include <vm.h>
+
+/** Load a program at 0x200, over memory which is zero everywhere else */
+static void load_program(Chip8VirtualMachine *vm, Chip8VirtualMachineType type, Chip8Variant variant,
+                         const uint8_t *program, size_t length)
+{
+    uint32_t mem_size = variant == VARIANT_XO_CHIP ? 65536 : 4096;
+
+    chip8vm_init(vm, type, variant, 1000);
+    memset(vm->state.memory + 0x200, 0, mem_size - 0x200);
+    memcpy(vm->state.memory + 0x200, program, length);
+}
+
+/** Run a program from 0x200 for 100 cycles, over memory which is zero everywhere else */
+static void run_program(Chip8VirtualMachine *vm, Chip8VirtualMachineType type, Chip8Variant variant,
+                        const uint8_t *program, size_t length)
+{
+    load_program(vm, type, variant, program, length);
+
+    assert_int_equal(chip8vm_run(vm, 100), CHIP8_OK);
+}
+
+/** Machines ran the same program, they must end in the same state */
+static void assert_same_state(Chip8 *expected, Chip8 *actual)
+{
+    assert_int_equal(actual->PC, expected->PC);
+    assert_int_equal(actual->I, expected->I);
+    assert_int_equal(actual->SP, expected->SP);
+    assert_memory_equal(actual->stack, expected->stack, sizeof expected->stack);
+    assert_memory_equal(actual->registers, expected->registers, sizeof expected->registers);
+    assert_int_equal(actual->cycles_since_started, expected->cycles_since_started);
+    assert_int_equal(actual->DT, expected->DT);
+    assert_int_equal(actual->ST, expected->ST);
+    assert_memory_equal(actual->memory, expected->memory, expected->variant == VARIANT_XO_CHIP ? 65536 : 4096);
+    assert_int_equal(actual->display_width, expected->display_width);
+    assert_int_equal(actual->display_height, expected->display_height);
+    assert_memory_equal(actual->display, expected->display, expected->display_width * expected->display_height);
+}
+
+/** Whether the block at from jumps straight into the block at to */
+static bool is_linked(Chip8VirtualMachine *vm, uint16_t from, uint16_t to)
+{
+    CodeCache *block = vm->vm_state.recompiler.cache->caches[from];
+
+    for (uint8_t i = 0; block && i < block->links_count; ++i)
+        if (block->links[i].target == to && block->links[i].linked)
+            return true;
+
+    return false;
+}
+
+/** Blocks chain into the blocks they exit to */
+static void test_recompiler_chained_blocks(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x70, 0x01,             // 202: ADD V0, 1
+        0x30, 0x20,             // 204: SE V0, 20
+        0x12, 0x02,             // 206: JP 202
+        0x12, 0x08,             // 208: JP 208
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.registers[0], 0x20);
+    assert_same_state(&interpreter.state, &recompiler.state);
+    assert_true(is_linked(&recompiler, 0x200, 0x202));
+    assert_true(is_linked(&recompiler, 0x202, 0x208));
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Guest registers living in host registers are written back before memory, calls and exits read them */
+static void test_recompiler_register_allocation(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x61, 0x85,             // 200: LD V1, 85
+        0x62, 0x7F,             // 202: LD V2, 7F
+        0x64, 0x00,             // 204: LD V4, 0
+        0x6A, 0x03,             // 206: LD VA, 3
+        0x81, 0x24,             // 208: ADD V1, V2
+        0x83, 0x10,             // 20A: LD V3, V1
+        0x83, 0x0E,             // 20C: SHL V3
+        0x85, 0xA4,             // 20E: ADD V5, VA
+        0xA3, 0x00,             // 210: LD I, 300
+        0xF5, 0x55,             // 212: LD [I], V5
+        0x00, 0xE0,             // 214: CLS
+        0xA3, 0x02,             // 216: LD I, 302
+        0xF0, 0x65,             // 218: LD V0, [I]
+        0x80, 0x54,             // 21A: ADD V0, V5
+        0x8D, 0x30,             // 21C: LD VD, V3
+        0x8D, 0x14,             // 21E: ADD VD, V1
+        0x74, 0x01,             // 220: ADD V4, 1
+        0x34, 0x04,             // 222: SE V4, 4
+        0x12, 0x08,             // 224: JP 208
+        0x12, 0x26,             // 226: JP 226
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.PC, 0x226);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Sprites drawn by translated code wrap around the display, and set VF on collisions */
+static void test_recompiler_draw_sprite(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x61, 0x3C,             // 202: LD V1, 3C
+        0x62, 0x1E,             // 204: LD V2, 1E
+        0xF0, 0x29,             // 206: LD F, V0
+        0xD1, 0x25,             // 208: DRW V1, V2, 5
+        0xD1, 0x25,             // 20A: DRW V1, V2, 5
+        0x83, 0xF0,             // 20C: LD V3, VF
+        0xD1, 0x25,             // 20E: DRW V1, V2, 5
+        0x70, 0x01,             // 210: ADD V0, 1
+        0x71, 0x05,             // 212: ADD V1, 5
+        0x30, 0x05,             // 214: SE V0, 5
+        0x12, 0x06,             // 216: JP 206
+        0x12, 0x18,             // 218: JP 218
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.PC, 0x218);
+    assert_int_equal(interpreter.state.registers[3], 1);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Translated loops run natively across many 60Hz slices, and stop at the cycle limit of each */
+static void test_recompiler_loop_budget(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x61, 0x00,             // 202: LD V1, 0
+        0x70, 0x01,             // 204: ADD V0, 1
+        0x30, 0x00,             // 206: SE V0, 0
+        0x12, 0x04,             // 208: JP 204
+        0x71, 0x01,             // 20A: ADD V1, 1
+        0x31, 0x03,             // 20C: SE V1, 3
+        0x12, 0x04,             // 20E: JP 204
+        0x12, 0x10,             // 210: JP 210
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    // Three times 256 iterations take longer than 100ms, keep going until the loop is done.
+    assert_int_equal(chip8vm_run(&interpreter, 3000), CHIP8_OK);
+    assert_int_equal(chip8vm_run(&recompiler, 3000), CHIP8_OK);
+
+    assert_int_equal(interpreter.state.registers[1], 3);
+    assert_int_equal(interpreter.state.cycles_since_started, 3000);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Machines running the same ROM share one translation cache */
+static void test_recompiler_shared_cache(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x70, 0x01,             // 202: ADD V0, 1
+        0x30, 0x20,             // 204: SE V0, 20
+        0x12, 0x02,             // 206: JP 202
+        0x12, 0x08,             // 208: JP 208
+    };
+
+    Chip8VirtualMachine interpreter, first, second;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&first, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&second, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_ptr_equal(first.vm_state.recompiler.cache, second.vm_state.recompiler.cache);
+    assert_int_equal(first.vm_state.recompiler.cache->references, 2);
+    assert_same_state(&interpreter.state, &first.state);
+    assert_same_state(&interpreter.state, &second.state);
+
+    // The remaining machine keeps running on the cache.
+    chip8vm_release(&first);
+    assert_int_equal(chip8vm_run(&interpreter, 200), CHIP8_OK);
+    assert_int_equal(chip8vm_run(&second, 200), CHIP8_OK);
+    assert_same_state(&interpreter.state, &second.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&second);
+}
+
+/** A machine started and released over and over by a thread, on a ROM of its own */
+typedef struct {
+    pthread_t thread;
+    uint8_t value;
+    uint8_t result;
+} SharedCacheThread;
+
+static void *run_shared_cache_thread(void *argument)
+{
+    SharedCacheThread *thread = (SharedCacheThread *) argument;
+    const uint8_t rom[] = {
+        0x60, thread->value,    // 200: LD V0, value
+        0x70, 0x01,             // 202: ADD V0, 1
+        0x12, 0x04,             // 204: JP 204
+    };
+
+    for (int i = 0; i < 50; ++i) {
+        Chip8VirtualMachine vm;
+
+        load_program(&vm, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+        chip8vm_run(&vm, 10);
+
+        thread->result = vm.state.registers[0];
+        chip8vm_release(&vm);
+    }
+
+    return NULL;
+}
+
+/** Machines running different ROMs on different threads attach to and release caches concurrently */
+static void test_recompiler_shared_cache_threads(void **state)
+{
+    (void) state;
+
+    SharedCacheThread threads[4];
+
+    for (uint8_t i = 0; i < 4; ++i) {
+        threads[i].value = i * 0x10;
+        threads[i].result = 0;
+        assert_int_equal(pthread_create(&threads[i].thread, NULL, run_shared_cache_thread, &threads[i]), 0);
+    }
+
+    for (uint8_t i = 0; i < 4; ++i) {
+        assert_int_equal(pthread_join(threads[i].thread, NULL), 0);
+        assert_int_equal(threads[i].result, i * 0x10 + 1);
+    }
+}
+
+/** Blocks are saved when the last machine of a ROM is released, and loaded back unless the file is corrupt */
+static void test_recompiler_disk_cache(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x70, 0x01,             // 202: ADD V0, 1
+        0x30, 0x20,             // 204: SE V0, 20
+        0x12, 0x02,             // 206: JP 202
+        0x12, 0x08,             // 208: JP 208
+    };
+
+    char directory[] = "/tmp/chip8-cache-XXXXXX";
+    assert_non_null(mkdtemp(directory));
+    recompiler_set_directory(directory);
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+    chip8vm_release(&recompiler);
+
+    char path[4096] = "";
+    DIR *dir = opendir(directory);
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir))
+        if (entry->d_name[0] != '.')
+            snprintf(path, sizeof path, "%s/%s", directory, entry->d_name);
+    closedir(dir);
+    assert_true(path[0] != '\0');
+
+    // Every block comes from the file, nothing is left to save.
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+    assert_non_null(recompiler.vm_state.recompiler.cache->caches[0x208]);
+    assert_false(recompiler.vm_state.recompiler.cache->unsaved);
+    assert_same_state(&interpreter.state, &recompiler.state);
+    chip8vm_release(&recompiler);
+
+    // The first block follows the header of 24 bytes and the memory, link it out of the cache.
+    CodeCache block;
+    FILE *file = fopen(path, "r+b");
+    assert_non_null(file);
+    assert_int_equal(fseek(file, 24 + 4096, SEEK_SET), 0);
+    assert_int_equal(fread(&block, sizeof block, 1, file), 1);
+    assert_int_equal(block.start, 0x200);
+    block.links[0].target = 0xFFFF;
+    assert_int_equal(fseek(file, 24 + 4096, SEEK_SET), 0);
+    assert_int_equal(fwrite(&block, sizeof block, 1, file), 1);
+    fclose(file);
+
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+    assert_true(recompiler.vm_state.recompiler.cache->unsaved);
+    assert_same_state(&interpreter.state, &recompiler.state);
+    chip8vm_release(&recompiler);
+
+    chip8vm_release(&interpreter);
+    remove(path);
+    rmdir(directory);
+    recompiler_set_directory(NULL);
+}
+
+/** VF computed lazily is still there when skips, arithmetic, stores and block exits read it */
+static void test_recompiler_lazy_vf(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0xF0,             // 200: LD V0, F0
+        0x61, 0x20,             // 202: LD V1, 20
+        0x80, 0x14,             // 204: ADD V0, V1      VF = 1, overwritten before being read
+        0x81, 0x04,             // 206: ADD V1, V0      VF = 0
+        0x3F, 0x00,             // 208: SE VF, 0
+        0x62, 0x01,             // 20A: LD V2, 1
+        0x63, 0x81,             // 20C: LD V3, 81
+        0x83, 0x36,             // 20E: SHR V3, V3      VF = 1
+        0x84, 0xF0,             // 210: LD V4, VF
+        0x65, 0xFF,             // 212: LD V5, FF
+        0x85, 0x54,             // 214: ADD V5, V5      VF = 1
+        0xA3, 0x00,             // 216: LD I, 300
+        0xFF, 0x55,             // 218: LD [I], VF
+        0x66, 0x10,             // 21A: LD V6, 10
+        0x67, 0x20,             // 21C: LD V7, 20
+        0x86, 0x75,             // 21E: SUB V6, V7      VF = 0, read by the exit
+        0x12, 0x22,             // 220: JP 222
+        0x12, 0x22,             // 222: JP 222
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.registers[2], 0);
+    assert_int_equal(interpreter.state.registers[4], 1);
+    assert_int_equal(interpreter.state.memory[0x30F], 1);
+    assert_int_equal(interpreter.state.registers[15], 0);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Blocks translated in the background are dropped when interpreted code overwrites them before they run */
+static void test_tiered_background(void **state)
+{
+    (void) state;
+
+    uint8_t rom[0x104] = {
+        0x23, 0x00,             // 200: CALL 300
+        0x23, 0x00,             // 202: CALL 300        300 is hot, and gets translated
+        0x60, 0x03,             // 204: LD V0, 3
+        0xA3, 0x01,             // 206: LD I, 301
+        0xF0, 0x55,             // 208: LD [I], V0      300 becomes ADD V1, 3
+        0x23, 0x00,             // 20A: CALL 300
+        0x12, 0x0C,             // 20C: JP 20C
+    };
+    const uint8_t subroutine[] = {
+        0x71, 0x01,             // 300: ADD V1, 1
+        0x00, 0xEE,             // 302: RET
+    };
+    memcpy(rom + 0x100, subroutine, sizeof subroutine);
+
+    Chip8VirtualMachine interpreter, tiered;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    assert_int_equal(interpreter.state.registers[1], 1 + 1 + 3);
+
+    load_program(&tiered, TIERED, VARIANT_CHIP8, rom, sizeof rom);
+    tiered.vm_state.tiered.threshold = 2;
+    tiered.vm_state.tiered.background = true;
+
+    // Give the worker time to translate 300, which is installed before the store.
+    assert_int_equal(chip8vm_run(&tiered, 6), CHIP8_OK);
+    assert_int_equal(tiered.state.PC, 0x204);
+    usleep(100000);
+    assert_int_equal(chip8vm_run(&tiered, 100), CHIP8_OK);
+
+    assert_same_state(&interpreter.state, &tiered.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&tiered);
+}
+
+/** Blocks go on through jumps and small subroutines */
+static void test_recompiler_superblocks(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x01,             // 200: LD V0, 1
+        0x12, 0x08,             // 202: JP 208
+        0x60, 0xFF,             // 204: LD V0, FF
+        0x00, 0x00,             // 206:
+        0x22, 0x10,             // 208: CALL 210
+        0x70, 0x02,             // 20A: ADD V0, 2
+        0x12, 0x0C,             // 20C: JP 20C
+        0x00, 0x00,             // 20E:
+        0x70, 0x04,             // 210: ADD V0, 4
+        0x00, 0xEE,             // 212: RET
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.registers[0], 7);
+    assert_same_state(&interpreter.state, &recompiler.state);
+    assert_int_equal(recompiler.vm_state.recompiler.cache->caches[0x200]->ranges_count, 4);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Hot code goes on along the jump after a skip, skipping it leaves the trace */
+static void test_tiered_trace(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x70, 0x01,             // 202: ADD V0, 1
+        0x30, 0x0C,             // 204: SE V0, C
+        0x12, 0x10,             // 206: JP 210
+        0x12, 0x08,             // 208: JP 208
+        0x00, 0x00,             // 20A:
+        0x00, 0x00,             // 20C:
+        0x00, 0x00,             // 20E:
+        0x71, 0x02,             // 210: ADD V1, 2
+        0x12, 0x02,             // 212: JP 202
+    };
+
+    Chip8VirtualMachine interpreter, tiered;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    load_program(&tiered, TIERED, VARIANT_CHIP8, rom, sizeof rom);
+    tiered.vm_state.tiered.threshold = 4;
+    assert_int_equal(chip8vm_run(&tiered, 100), CHIP8_OK);
+
+    assert_int_equal(interpreter.state.registers[0], 0x0C);
+    assert_same_state(&interpreter.state, &tiered.state);
+    assert_int_equal(tiered.vm_state.tiered.recompiler.cache->caches[0x202]->ranges_count, 2);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&tiered);
+}
+
+/** Returns from a subroutine too big to inline jump straight back into the block after each CALL */
+static void test_recompiler_return_prediction(void **state)
+{
+    (void) state;
+
+    uint8_t rom[0x10E] = {
+        0x23, 0x00,             // 200: CALL 300
+        0x71, 0x01,             // 202: ADD V1, 1
+        0x23, 0x00,             // 204: CALL 300
+        0x71, 0x02,             // 206: ADD V1, 2
+        0x23, 0x00,             // 208: CALL 300
+        0x71, 0x04,             // 20A: ADD V1, 4
+        0x12, 0x0C,             // 20C: JP 20C
+    };
+    const uint8_t subroutine[] = {
+        0x62, 0x00,             // 300: LD V2, 0
+        0x72, 0x01,             // 302: ADD V2, 1
+        0x42, 0x03,             // 304: SNE V2, 3
+        0x13, 0x0A,             // 306: JP 30A
+        0x13, 0x02,             // 308: JP 302          the loop keeps it from being inlined
+        0x70, 0x01,             // 30A: ADD V0, 1
+        0x00, 0xEE,             // 30C: RET
+    };
+    memcpy(rom + 0x100, subroutine, sizeof subroutine);
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.registers[0], 3);
+    assert_int_equal(interpreter.state.registers[1], 7);
+    assert_same_state(&interpreter.state, &recompiler.state);
+    assert_int_equal(recompiler.state.return_calls[0], 0x208);
+    assert_non_null(recompiler.state.return_code[0]);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** A subroutine overwriting the code after its CALL must not return into the stale translation */
+static void test_recompiler_return_prediction_dropped(void **state)
+{
+    (void) state;
+
+    uint8_t rom[0x118] = {
+        0x23, 0x00,             // 200: CALL 300
+        0x71, 0x01,             // 202: ADD V1, 1       patched into ADD V1, 5 by the third call
+        0x33, 0x03,             // 204: SE V3, 3
+        0x12, 0x00,             // 206: JP 200
+        0x12, 0x08,             // 208: JP 208
+    };
+    const uint8_t subroutine[] = {
+        0x62, 0x00,             // 300: LD V2, 0
+        0x72, 0x01,             // 302: ADD V2, 1
+        0x42, 0x02,             // 304: SNE V2, 2
+        0x13, 0x0A,             // 306: JP 30A
+        0x13, 0x02,             // 308: JP 302
+        0x73, 0x01,             // 30A: ADD V3, 1
+        0x33, 0x03,             // 30C: SE V3, 3
+        0x00, 0xEE,             // 30E: RET
+        0x60, 0x05,             // 310: LD V0, 5
+        0xA2, 0x03,             // 312: LD I, 203
+        0xF0, 0x55,             // 314: LD [I], V0
+        0x00, 0xEE,             // 316: RET
+    };
+    memcpy(rom + 0x100, subroutine, sizeof subroutine);
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.registers[1], 1 + 1 + 5);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** Translated blocks are described in the perf map of the process, without changing what they do */
+static void test_recompiler_perf_map(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x00,             // 200: LD V0, 0
+        0x70, 0x01,             // 202: ADD V0, 1
+        0x30, 0x20,             // 204: SE V0, 20
+        0x12, 0x02,             // 206: JP 202
+        0x12, 0x08,             // 208: JP 208
+    };
+
+    recompiler_set_perf_map(true);
+
+    Chip8VirtualMachine interpreter, recompiler;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_CHIP8, rom, sizeof rom);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    char path[64], line[256];
+    bool found = false;
+    snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) getpid());
+    FILE *file = fopen(path, "r");
+    assert_non_null(file);
+    while (fgets(line, sizeof line, file))
+        found |= strstr(line, " CHIP-8 200-") != NULL;
+    fclose(file);
+    assert_true(found);
+
+    recompiler_set_perf_map(false);
+    remove(path);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** The k-th timer decrement happens at cycle ceil(k * clock_speed / 60), whatever the clock speed */
+static void test_timer_schedule(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x12, 0x00,             // 200: JP 200
+    };
+    const uint32_t clock_speeds[] = { 1000, 500, 61, 60, 59, 7, 1 };
+
+    for (size_t i = 0; i < sizeof clock_speeds / sizeof clock_speeds[0]; ++i) {
+        uint32_t clock_speed = clock_speeds[i];
+        Chip8VirtualMachine vm;
+
+        chip8vm_init(&vm, INTERPRETER, VARIANT_CHIP8, clock_speed);
+        memcpy(vm.state.memory + 0x200, rom, sizeof rom);
+        vm.state.DT = 255;
+
+        for (uint32_t ticks = 0; ticks <= 6000; ticks += 37) {
+            uint64_t cycles = (uint64_t) ticks * clock_speed / 1000;
+            uint64_t decrements = cycles * 60 / clock_speed;
+
+            assert_int_equal(chip8vm_run(&vm, ticks), CHIP8_OK);
+            assert_int_equal(vm.cycles, cycles);
+            assert_int_equal(vm.state.DT, decrements < 255 ? 255 - decrements : 0);
+        }
+
+        chip8vm_release(&vm);
+    }
+}
+
+/** Stepping runs a single instruction, even on machines which run whole slices at once */
+static void test_step(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x01,             // 200: LD V0, 1
+        0x61, 0x02,             // 202: LD V1, 2
+        0x12, 0x04,             // 204: JP 204
+    };
+    const Chip8VirtualMachineType types[] = { INTERPRETER, TIERED, THREADED };
+
+    for (size_t i = 0; i < sizeof types / sizeof types[0]; ++i) {
+        Chip8VirtualMachine vm;
+        load_program(&vm, types[i], VARIANT_CHIP8, rom, sizeof rom);
+
+        assert_int_equal(chip8vm_step(&vm), CHIP8_OK);
+        assert_int_equal(vm.state.PC, 0x202);
+        assert_int_equal(vm.state.registers[1], 0);
+        assert_int_equal(vm.cycles, 1);
+
+        assert_int_equal(chip8vm_step(&vm), CHIP8_OK);
+        assert_int_equal(vm.state.PC, 0x204);
+        assert_int_equal(vm.cycles, 2);
+
+        chip8vm_release(&vm);
+    }
+}
+
+/** Translated code waiting on DT sees the same timer decrements as the interpreter, at clock speeds which do not divide by 60 */
+static void test_run_engines(void **state)
+{
+    (void) state;
+
+    // Count in translatable memory, and past it where the recompiler falls back to the interpreter.
+    uint8_t rom[0xE08] = {
+        0x60, 0x02,             // 200: LD V0, 2
+        0x71, 0x01,             // 202: ADD V1, 1
+        0xBF, 0xFE,             // 204: JP V0, FFE
+        0x12, 0x06,             // 206: JP 206
+    };
+    const uint8_t high[] = {
+        0x72, 0x01,             // 1000: ADD V2, 1
+        0x32, 0x08,             // 1002: SE V2, 8
+        0x12, 0x02,             // 1004: JP 202
+        0x12, 0x06,             // 1006: JP 206
+    };
+    memcpy(rom + 0xE00, high, sizeof high);
+
+    const Chip8VirtualMachineType types[] = { RECOMPILER, TIERED, THREADED };
+
+    Chip8VirtualMachine interpreter;
+    run_program(&interpreter, INTERPRETER, VARIANT_XO_CHIP, rom, sizeof rom);
+    assert_int_equal(interpreter.state.PC, 0x206);
+
+    for (size_t i = 0; i < sizeof types / sizeof types[0]; ++i) {
+        Chip8VirtualMachine vm;
+        run_program(&vm, types[i], VARIANT_XO_CHIP, rom, sizeof rom);
+
+        assert_same_state(&interpreter.state, &vm.state);
+        assert_int_equal(interpreter.cycles, vm.cycles);
+        assert_int_equal(interpreter.next_timer, vm.next_timer);
+
+        chip8vm_release(&vm);
+    }
+
+    chip8vm_release(&interpreter);
+}
+
+static void test_recompiler_timers(void **state)
+{
+    (void) state;
+
+    const uint8_t rom[] = {
+        0x60, 0x03,             // 200: LD V0, 3
+        0xF0, 0x15,             // 202: LD DT, V0
+        0xF1, 0x07,             // 204: LD V1, DT
+        0x31, 0x00,             // 206: SE V1, 0
+        0x12, 0x04,             // 208: JP 204
+        0x72, 0x01,             // 20A: ADD V2, 1
+        0x32, 0x04,             // 20C: SE V2, 4
+        0x12, 0x00,             // 20E: JP 200
+        0x63, 0x30,             // 210: LD V3, 30
+        0xF3, 0x18,             // 212: LD ST, V3
+        0x12, 0x14,             // 214: JP 214
+    };
+    const uint32_t clock_speeds[] = { 1000, 999, 777, 610 };
+
+    for (size_t i = 0; i < sizeof clock_speeds / sizeof clock_speeds[0]; ++i) {
+        Chip8VirtualMachine interpreter, recompiler;
+
+        chip8vm_init(&interpreter, INTERPRETER, VARIANT_CHIP8, clock_speeds[i]);
+        chip8vm_init(&recompiler, RECOMPILER, VARIANT_CHIP8, clock_speeds[i]);
+        memcpy(interpreter.state.memory + 0x200, rom, sizeof rom);
+        memcpy(recompiler.state.memory + 0x200, rom, sizeof rom);
+
+        // Stop while ST is still counting down.
+        assert_int_equal(chip8vm_run(&interpreter, 400), CHIP8_OK);
+        assert_int_equal(chip8vm_run(&recompiler, 400), CHIP8_OK);
+
+        assert_int_equal(interpreter.state.registers[2], 4);
+        assert_int_not_equal(interpreter.state.ST, 0);
+        assert_same_state(&interpreter.state, &recompiler.state);
+        assert_int_equal(interpreter.cycles, recompiler.cycles);
+        assert_int_equal(interpreter.next_timer, recompiler.next_timer);
+
+        chip8vm_release(&interpreter);
+        chip8vm_release(&recompiler);
+    }
+}
+
+/** A skip decided at translation time over F000 NNNN must still move past its operand */
+static void test_recompiler_skipped_ld_i_nnnn(void **state)
+{
+    (void) state;
+
+    const uint8_t program[] = {
+        0x60, 0x01,             // 200: LD V0, 1
+        0x30, 0x01,             // 202: SE V0, 1
+        0xF0, 0x00, 0x12, 0x34, // 204: LD I, 1234
+        0x23, 0x00,             // 208: CALL 300
+        0x12, 0x0A,             // 20A: JP 20A
+    };
+    const uint8_t subroutine[] = {
+        0x13, 0x00,             // 300: JP 300
+    };
+
+    Chip8VirtualMachine interpreter, recompiler;
+    uint8_t rom[0x102] = { 0 };
+    memcpy(rom, program, sizeof program);
+    memcpy(rom + 0x100, subroutine, sizeof subroutine);
+
+    run_program(&interpreter, INTERPRETER, VARIANT_XO_CHIP, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_XO_CHIP, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.stack[0], 0x208);
+    assert_same_state(&interpreter.state, &recompiler.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+}
+
+/** XO-Chip code past the first 4KB is interpreted */
+static void test_recompiler_high_memory(void **state)
+{
+    (void) state;
+
+    uint8_t rom[0xE04] = {
+        0x60, 0x02,             // 200: LD V0, 2
+        0xBF, 0xFE,             // 202: JP V0, FFE
+    };
+    const uint8_t high[] = {
+        0x71, 0x01,             // 1000: ADD V1, 1
+        0xBF, 0xFE,             // 1002: JP V0, FFE
+    };
+    memcpy(rom + 0xE00, high, sizeof high);
+
+    Chip8VirtualMachine interpreter, recompiler, tiered;
+    run_program(&interpreter, INTERPRETER, VARIANT_XO_CHIP, rom, sizeof rom);
+    run_program(&recompiler, RECOMPILER, VARIANT_XO_CHIP, rom, sizeof rom);
+    run_program(&tiered, TIERED, VARIANT_XO_CHIP, rom, sizeof rom);
+
+    assert_same_state(&interpreter.state, &recompiler.state);
+    assert_same_state(&interpreter.state, &tiered.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&recompiler);
+    chip8vm_release(&tiered);
+}
+
+/** Threaded code decodes instructions again once they get overwritten */
+static void test_threaded_self_modifying(void **state)
+{
+    (void) state;
+
+    uint8_t rom[0x104] = {
+        0x60, 0x05,             // 200: LD V0, 5
+        0x61, 0x01,             // 202: LD V1, 1
+        0x23, 0x00,             // 204: CALL 300
+        0x70, 0xFF,             // 206: ADD V0, FF
+        0x30, 0x00,             // 208: SE V0, 0
+        0x12, 0x04,             // 20A: JP 204
+        0x60, 0x73,             // 20C: LD V0, 73
+        0x61, 0x01,             // 20E: LD V1, 1
+        0xA3, 0x00,             // 210: LD I, 300
+        0xF1, 0x55,             // 212: LD [I], V1
+        0x23, 0x00,             // 214: CALL 300
+        0x12, 0x16,             // 216: JP 216
+    };
+    const uint8_t subroutine[] = {
+        0x82, 0x14,             // 300: ADD V2, V1, then ADD V3, 1 once overwritten
+        0x00, 0xEE,             // 302: RET
+    };
+    memcpy(rom + 0x100, subroutine, sizeof subroutine);
+
+    Chip8VirtualMachine interpreter, threaded;
+    run_program(&interpreter, INTERPRETER, VARIANT_CHIP8, rom, sizeof rom);
+    run_program(&threaded, THREADED, VARIANT_CHIP8, rom, sizeof rom);
+
+    assert_int_equal(interpreter.state.registers[2], 5);
+    assert_int_equal(interpreter.state.registers[3], 1);
+    assert_same_state(&interpreter.state, &threaded.state);
+
+    chip8vm_release(&interpreter);
+    chip8vm_release(&threaded);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_recompiler_chained_blocks),
+        cmocka_unit_test(test_recompiler_register_allocation),
+        cmocka_unit_test(test_recompiler_draw_sprite),
+        cmocka_unit_test(test_recompiler_loop_budget),
+        cmocka_unit_test(test_recompiler_shared_cache),
+        cmocka_unit_test(test_recompiler_shared_cache_threads),
+        cmocka_unit_test(test_recompiler_disk_cache),
+        cmocka_unit_test(test_recompiler_lazy_vf),
+        cmocka_unit_test(test_tiered_background),
+        cmocka_unit_test(test_recompiler_superblocks),
+        cmocka_unit_test(test_tiered_trace),
+        cmocka_unit_test(test_recompiler_return_prediction),
+        cmocka_unit_test(test_recompiler_return_prediction_dropped),
+        cmocka_unit_test(test_recompiler_perf_map),
+        cmocka_unit_test(test_timer_schedule),
+        cmocka_unit_test(test_step),
+        cmocka_unit_test(test_recompiler_timers),
+        cmocka_unit_test(test_run_engines),
+        cmocka_unit_test(test_recompiler_skipped_ld_i_nnnn),
+        cmocka_unit_test(test_recompiler_high_memory),
+        cmocka_unit_test(test_threaded_self_modifying),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,198 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include <recompiler/x64.h>
+
+static int setup(void **state)
+{
+    X86fn *func = malloc(sizeof(X86fn));
+    func->buffer = malloc(256);
+    func->buffer_size = 256;
+    func->buffer_ptr = 0;
+    *state = func;
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    X86fn *func = *state;
+    free(func->buffer);
+    free(func);
+
+    return 0;
+}
+
+/** Check the bytes written so far, and start over */
+static void assert_code(X86fn *func, const uint8_t *expected, uint32_t length)
+{
+    assert_int_equal(func->buffer_ptr, length);
+    assert_memory_equal(func->buffer, expected, length);
+    func->buffer_ptr = 0;
+}
+
+#define ASSERT_CODE(func, ...)                                  \
+    do {                                                        \
+        const uint8_t expected[] = { __VA_ARGS__ };             \
+        assert_code(func, expected, sizeof expected);           \
+    } while (0)
+
+/** r12 and r13 as pointers need a SIB byte and a displacement */
+static void test_mem_escapes(void **state)
+{
+    X86fn *func = *state;
+
+    x64_mov_regmem8(func, EAX, R12, 0); // mov al, [r12]
+    ASSERT_CODE(func, 0x41, 0x8A, 0x04, 0x24);
+
+    x64_mov_regmem8(func, EAX, R13, 0); // mov al, [r13 + 0]
+    ASSERT_CODE(func, 0x41, 0x8A, 0x45, 0x00);
+
+    x64_mov_regmem8(func, EAX, EBP, 0); // mov al, [rbp + 0]
+    ASSERT_CODE(func, 0x8A, 0x45, 0x00);
+}
+
+/** disp8 is sign-extended: it holds -128...127 */
+static void test_mem_displacement(void **state)
+{
+    X86fn *func = *state;
+
+    x64_movzx_regmem8(func, EAX, EBX, 0x80); // movzx eax, byte [rbx + 0x80]
+    ASSERT_CODE(func, 0x0F, 0xB6, 0x83, 0x80, 0x00, 0x00, 0x00);
+
+    x64_mov_memreg8(func, EBX, -128, R9); // mov [rbx - 128], r9b
+    ASSERT_CODE(func, 0x44, 0x88, 0x4B, 0x80);
+}
+
+static void test_mem_indexed(void **state)
+{
+    X86fn *func = *state;
+
+    x64_mov_idxreg16(func, EBX, EDX, X64_SCALE_2, 0x58, EAX); // mov [rbx + rdx*2 + 0x58], ax
+    ASSERT_CODE(func, 0x66, 0x89, 0x44, 0x53, 0x58);
+
+    x64_mov_regidx64(func, EAX, EBX, EDX, X64_SCALE_8, 0x1000); // mov rax, [rbx + rdx*8 + 0x1000]
+    ASSERT_CODE(func, 0x48, 0x8B, 0x84, 0xD3, 0x00, 0x10, 0x00, 0x00);
+
+    x64_mov_idxreg8(func, EDX, R12, X64_SCALE_1, 3, ESI); // mov [rdx + r12 + 3], sil
+    ASSERT_CODE(func, 0x42, 0x88, 0x74, 0x22, 0x03);
+}
+
+static void test_registers(void **state)
+{
+    X86fn *func = *state;
+
+    x64_mov_regreg64(func, R15, EAX); // mov r15, rax
+    ASSERT_CODE(func, 0x49, 0x89, 0xC7);
+
+    x64_movzx_regreg8(func, EAX, ESI); // movzx eax, sil
+    ASSERT_CODE(func, 0x40, 0x0F, 0xB6, 0xC6);
+}
+
+static void test_prologue(void **state)
+{
+    X86fn *func = *state;
+    const X86reg saved[] = { EBX, EBP, R12, R13, R14, R15 };
+
+    // Return address and 6 registers take 56 bytes: 8 more keep calls aligned.
+    x64_prologue(func, saved, 6);
+    ASSERT_CODE(func, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x81, 0xEC, 0x08, 0x00, 0x00, 0x00);
+
+    x64_epilogue(func, saved, 6);
+    ASSERT_CODE(func, 0x48, 0x81, 0xC4, 0x08, 0x00, 0x00, 0x00, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3);
+
+    x64_prologue(func, saved, 1);
+    ASSERT_CODE(func, 0x53);
+}
+
+static void test_labels(void **state)
+{
+    X86fn *func = *state;
+    X64Label label;
+
+    // Forward: rel32, patched when bound.
+    x64_label_init(&label);
+    x64_jcc_label(func, X64_Z, &label);
+    x64_retn(func);
+    x64_label_bind(func, &label);
+    ASSERT_CODE(func, 0x0F, 0x84, 0x01, 0x00, 0x00, 0x00, 0xC3);
+
+    // Backward: rel8 when it reaches.
+    x64_label_init(&label);
+    x64_label_bind(func, &label);
+    x64_retn(func);
+    x64_jmp_label(func, &label);
+    ASSERT_CODE(func, 0xC3, 0xEB, 0xFD);
+
+    // Any number of jumps can wait for the same label.
+    x64_label_init(&label);
+    for (int i = 0; i < 5; ++i)
+        x64_jmp_label(func, &label);
+    x64_label_bind(func, &label);
+    ASSERT_CODE(func,
+        0xE9, 0x14, 0x00, 0x00, 0x00,
+        0xE9, 0x0F, 0x00, 0x00, 0x00,
+        0xE9, 0x0A, 0x00, 0x00, 0x00,
+        0xE9, 0x05, 0x00, 0x00, 0x00,
+        0xE9, 0x00, 0x00, 0x00, 0x00);
+}
+
+/** Functions are written one after the other in a shared arena, which runs them once locked */
+static void test_arena(void **state)
+{
+    (void) state;
+    X64Arena arena;
+    X86fn first, second, third;
+
+    assert_int_equal(x64_arena_init(&arena, 4096), 0);
+
+    assert_int_equal(x64_arena_begin(&arena, &first, 64), 0);
+    x64_mov_regimm32(&first, EAX, 1);
+    x64_retn(&first);
+    x64_arena_end(&arena, &first);
+
+    assert_int_equal(x64_arena_begin(&arena, &second, 64), 0);
+    x64_mov_regimm32(&second, EAX, 2);
+    x64_retn(&second);
+    x64_arena_end(&arena, &second);
+
+    // Each function starts on an aligned boundary, right after the previous one.
+    assert_ptr_equal(first.buffer, arena.buffer);
+    assert_ptr_equal(second.buffer, arena.buffer + X64_ALIGN);
+    assert_int_equal(arena.used, 2 * X64_ALIGN);
+
+    // Code only runs once the arena is executable, and is only written while it is not.
+    assert_int_equal(x64_run(&arena, first.buffer, NULL), -1);
+    assert_int_equal(x64_arena_lock(&arena), 0);
+    assert_int_equal(x64_run(&arena, first.buffer, NULL), 1);
+    assert_int_equal(x64_run(&arena, second.buffer, NULL), 2);
+    assert_int_equal(x64_arena_begin(&arena, &third, 64), -1);
+
+    // A function which does not fit is refused, until the arena gets reset.
+    assert_int_equal(x64_arena_unlock(&arena), 0);
+    assert_int_equal(x64_arena_begin(&arena, &third, 4096), -1);
+    x64_arena_reset(&arena);
+    assert_int_equal(x64_arena_begin(&arena, &third, 4096), 0);
+    assert_ptr_equal(third.buffer, arena.buffer);
+
+    assert_int_equal(x64_arena_release(&arena), 0);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_mem_escapes, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_mem_displacement, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_mem_indexed, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_registers, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_prologue, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_labels, setup, teardown),
+        cmocka_unit_test(test_arena),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}